@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "dispatcher.h"
+#include "mempool/mempool.h"
+
+#define SUCCESS 0
+#define ERROR -1
+
+#define MAX_CLIENT 256
+
+/* A client is queued at most once, so a run queue never holds more */
+#define RUNQ_SIZE MAX_CLIENT
+
+/*
+* NAME :        endpoint_s
+*
+* DESCRIPTION : Dispatcher state of a client
+*
+* MEMBERS :     handler - Message handler, NULL when not registered
+*               arg - Argument of handler
+*               scheduled - Set while the client sits in a run queue or is
+*                           being served by a worker
+*
+* NOTES :      None
+*/
+struct endpoint_s
+{
+  msg_handler_fn handler;
+  void *arg;
+  atomic_int scheduled;
+};
+
+/*
+* NAME :        worker_s
+*
+* DESCRIPTION : Worker thread and its run queue
+*
+* MEMBERS :     tid - Thread ID
+*               lock - Protects the run queue
+*               runq - Ring of runnable client IDs
+*               head - Index of the oldest entry
+*               count - Number of entries
+*
+* NOTES :      The owner and thieves both take the oldest entry, so a client
+*              queued again after its batch runs after the clients already
+*              waiting.
+*/
+struct worker_s
+{
+  pthread_t tid;
+  pthread_mutex_t lock;
+  uint8_t runq[RUNQ_SIZE];
+  uint32_t head;
+  uint32_t count;
+};
+
+static struct endpoint_s eptable[MAX_CLIENT] = {0};
+static struct worker_s workers[DISPATCHER_MAX_WORKERS];
+static atomic_uint num_workers = 0;
+static sem_t work_sema;
+static atomic_int stopping = 0;
+static atomic_uint next_worker = 0;
+
+/* Index of the worker running on this thread, -1 for other threads */
+static __thread int worker_self = -1;
+
+/*
+* NAME :        runq_push
+*
+* DESCRIPTION : Queues a runnable client and wakes a worker
+*
+* INPUTS :      client_id - ID of client
+*               num - Number of workers read once by the caller
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API. Clients made runnable by a worker stay
+*               on that worker's queue; others are spread round-robin.
+*/
+static void runq_push(
+  uint8_t client_id,
+  uint32_t num)
+{
+  struct worker_s *workerp = NULL;
+
+  if (worker_self >= 0)
+  {
+    workerp = &workers[worker_self];
+  }
+  else
+  {
+    workerp = &workers[atomic_fetch_add(&next_worker, 1) % num];
+  }
+
+  pthread_mutex_lock(&workerp->lock);
+  workerp->runq[(workerp->head + workerp->count) % RUNQ_SIZE] = client_id;
+  workerp->count++;
+  pthread_mutex_unlock(&workerp->lock);
+
+  sem_post(&work_sema);
+}
+
+/*
+* NAME :        runq_pop
+*
+* DESCRIPTION : Takes a runnable client from a worker's run queue
+*
+* INPUTS :      workerp - worker to take from
+*               client_id - Buffer to store the client ID
+*
+* OUTPUTS :     TRUE - A client was taken
+*               FALSE - The run queue is empty
+*
+* NOTES :       It is a static API
+*/
+static boolean runq_pop(
+  struct worker_s *workerp,
+  uint8_t *client_id)
+{
+  boolean res = FALSE;
+
+  pthread_mutex_lock(&workerp->lock);
+  if (workerp->count)
+  {
+    *client_id = workerp->runq[workerp->head];
+    workerp->head = (workerp->head + 1) % RUNQ_SIZE;
+    workerp->count--;
+    res = TRUE;
+  }
+  pthread_mutex_unlock(&workerp->lock);
+
+  return res;
+}
+
+/*
+* NAME :        dispatcher_notify
+*
+* DESCRIPTION : Makes a client runnable when a message is sent to it
+*
+* INPUTS :      client_id - ID of client
+*               arg - Not used
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API, called on the sender's thread.
+*               dispatcher_stop detaches the hook and waits for running
+*               notifications before the workers go away, so the number of
+*               workers read here stays valid until it returns.
+*/
+static void dispatcher_notify(
+  uint8_t client_id,
+  void *arg)
+{
+  uint32_t num = 0;
+
+  if (0 == atomic_exchange(&eptable[client_id].scheduled, 1))
+  {
+    num = atomic_load(&num_workers);
+    if (0 == num)
+    {
+      /* Not started; dispatcher_start picks the message up */
+      atomic_store(&eptable[client_id].scheduled, 0);
+      return;
+    }
+    runq_push(client_id, num);
+  }
+}
+
+/*
+* NAME :        dispatcher_serve
+*
+* DESCRIPTION : Runs the handler of a client on a batch of its messages
+*
+* INPUTS :      client_id - ID of client
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API. The caller owns the client's scheduled
+*               flag, so messages of a client are handled in order.
+*/
+static void dispatcher_serve(
+  uint8_t client_id)
+{
+  struct endpoint_s *endp = &eptable[client_id];
+  client_stat_t stat;
+  message_t *msg = NULL;
+
+  for (int i = 0; i < DISPATCHER_BATCH; i++)
+  {
+    if (try_recv(client_id, &msg) != SUCCESS)
+    {
+      break;
+    }
+    endp->handler(client_id, msg, endp->arg);
+  }
+
+  /* Release the client. A message queued before the release did not
+  * schedule it, so check the mailbox again and take the client back.
+  */
+  atomic_store(&endp->scheduled, 0);
+  if (SUCCESS == client_get_stat(client_id, &stat) && stat.depth &&
+      0 == atomic_exchange(&endp->scheduled, 1))
+  {
+    runq_push(client_id, atomic_load(&num_workers));
+  }
+}
+
+/*
+* NAME :        worker_fcn
+*
+* DESCRIPTION : Worker thread. Serves clients from its own run queue and
+*               steals from other workers when it is empty.
+*
+* INPUTS :      arg - Index of the worker
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API
+*/
+static void * worker_fcn(
+  void *arg)
+{
+  uint32_t self = (uint32_t) (uintptr_t) arg;
+  uint32_t num = 0;
+  uint8_t client_id = 0;
+  boolean found = FALSE;
+
+  worker_self = (int) self;
+
+  while (1)
+  {
+    if (sem_wait(&work_sema) != SUCCESS)
+    {
+      continue;
+    }
+
+    if (atomic_load(&stopping))
+    {
+      break;
+    }
+
+    /* Every post matches a queued client, so keep looking until one is found */
+    num = atomic_load(&num_workers);
+    found = FALSE;
+    while (!found)
+    {
+      found = runq_pop(&workers[self], &client_id);
+      for (uint32_t i = 1; !found && i < num; i++)
+      {
+        found = runq_pop(&workers[(self + i) % num], &client_id);
+      }
+    }
+
+    dispatcher_serve(client_id);
+  }
+
+  return NULL;
+}
+
+/*
+* NAME :        dispatcher_register
+*
+* DESCRIPTION : Serves a client with a handler instead of a blocking thread
+*
+* INPUTS :      client_id - ID of client
+*               handler - Message handler
+*               arg - Argument passed to handler
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       The client must not also call recv.
+*/
+int dispatcher_register(
+  uint8_t client_id,
+  msg_handler_fn handler,
+  void *arg)
+{
+  if (!handler)
+  {
+    printf("%s - Error: Invalid handler.\n", __func__);
+    return ERROR;
+  }
+
+  eptable[client_id].arg = arg;
+  eptable[client_id].handler = handler;
+
+  return client_set_notify(client_id, dispatcher_notify, NULL);
+}
+
+/*
+* NAME :        dispatcher_start
+*
+* DESCRIPTION : Starts the worker threads
+*
+* INPUTS :      num - Number of workers, usually one per core
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       This function is not thread safe. Clients may be registered
+*               before or after the workers start; messages queued before
+*               the start are handled once the workers run. Clients keep
+*               their handlers across dispatcher_stop and dispatcher_start.
+*/
+int dispatcher_start(
+  uint32_t num)
+{
+  if (0 == num || num > DISPATCHER_MAX_WORKERS || atomic_load(&num_workers))
+  {
+    printf("%s - Error: Incorrect input parameters.\n", __func__);
+    return ERROR;
+  }
+
+  if (sem_init(&work_sema, 0, 0) != SUCCESS)
+  {
+    printf("%s - Error: Cannot initialize semaphore.\n", __func__);
+    return ERROR;
+  }
+
+  atomic_store(&stopping, 0);
+  for (uint32_t i = 0; i < num; i++)
+  {
+    memset(&workers[i], 0, sizeof(workers[i]));
+    pthread_mutex_init(&workers[i].lock, NULL);
+  }
+
+  /* Senders see no workers, and queue nothing, until all of them run */
+  for (uint32_t i = 0; i < num; i++)
+  {
+    if (pthread_create(&workers[i].tid, NULL, worker_fcn, (void *) (uintptr_t) i) != SUCCESS)
+    {
+      printf("%s - Error: Cannot create worker.\n", __func__);
+      for (uint32_t j = i; j < num; j++)
+      {
+        pthread_mutex_destroy(&workers[j].lock);
+      }
+      atomic_store(&num_workers, i);
+      dispatcher_stop();
+      return ERROR;
+    }
+  }
+  atomic_store(&num_workers, num);
+
+  /* Attach the clients again after a stop and schedule clients that
+  * received messages before the start.
+  */
+  for (uint32_t i = 0; i < MAX_CLIENT; i++)
+  {
+    if (eptable[i].handler)
+    {
+      client_set_notify((uint8_t) i, dispatcher_notify, NULL);
+      dispatcher_notify((uint8_t) i, NULL);
+    }
+  }
+
+  return SUCCESS;
+}
+
+/*
+* NAME :        dispatcher_stop
+*
+* DESCRIPTION : Stops and joins the worker threads
+*
+* INPUTS :      None
+*
+* OUTPUTS :     None
+*
+* NOTES :       Messages still queued stay in the client mailboxes and
+*               are handled after the next dispatcher_start. Senders may
+*               keep sending while the workers stop: the clients are
+*               detached first, which waits for notifications that are
+*               running. It must not be called from a handler.
+*/
+void dispatcher_stop(
+  void)
+{
+  uint32_t num = atomic_load(&num_workers);
+  uint8_t client_id = 0;
+
+  for (uint32_t i = 0; i < MAX_CLIENT; i++)
+  {
+    if (eptable[i].handler)
+    {
+      client_clear_notify((uint8_t) i, dispatcher_notify, NULL);
+    }
+  }
+
+  atomic_store(&stopping, 1);
+  for (uint32_t i = 0; i < num; i++)
+  {
+    sem_post(&work_sema);
+  }
+
+  for (uint32_t i = 0; i < num; i++)
+  {
+    pthread_join(workers[i].tid, NULL);
+  }
+
+  /* Clients left in the run queues were never served; release them so
+  * dispatcher_start can schedule them again.
+  */
+  for (uint32_t i = 0; i < num; i++)
+  {
+    while (runq_pop(&workers[i], &client_id))
+    {
+      atomic_store(&eptable[client_id].scheduled, 0);
+    }
+    pthread_mutex_destroy(&workers[i].lock);
+  }
+
+  atomic_store(&num_workers, 0);
+  sem_destroy(&work_sema);
+}
@@ -0,0 +1,36 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+#include <stdint.h>
+
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of worker threads */
+#define DISPATCHER_MAX_WORKERS 64
+
+/* Messages handled per client before the worker moves to the next client */
+#define DISPATCHER_BATCH 16
+
+/*
+* Message handler of a client. It owns msg and must delete or forward it.
+* Handlers of one client are never run concurrently.
+*/
+typedef void (*msg_handler_fn)(uint8_t client_id, message_t *msg, void *arg);
+
+extern int dispatcher_register(
+  uint8_t client_id,
+  msg_handler_fn handler,
+  void *arg);
+
+extern int dispatcher_start(
+  uint32_t num_workers);
+
+extern void dispatcher_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "dispatcher.h"
+
+#define NUM_WORKERS 4
+#define NUM_EP 64
+#define NUM_MSG_PER_EP 500
+#define MAX_IN_FLIGHT 16
+
+/* Fairness test: one client keeps itself busy, another gets one message */
+#define BUSY_ID NUM_EP
+#define QUIET_ID (NUM_EP + 1)
+#define FAIR_TIMEOUT_MS 2000
+
+/* Stop/start test: workers are restarted while another thread sends */
+#define NUM_CYCLES 50
+#define NUM_CYCLE_MSG 100
+
+static uint32_t next_seq[NUM_EP];
+static atomic_int in_handler[NUM_EP];
+static atomic_int handled = 0;
+static atomic_int busy_handled = 0;
+static atomic_int busy_stop = 0;
+static atomic_int busy_done = 0;
+static atomic_int quiet_handled = 0;
+
+/*
+* NAME :        handler_fcn
+*
+* DESCRIPTION : Checks that messages of an endpoint arrive in order and are
+*               never handled by two workers at the same time
+*
+* INPUTS :      client_id - ID of endpoint
+*               msg - Received message
+*               arg - Not used
+*
+* OUTPUTS :     None
+*
+*/
+static void handler_fcn(uint8_t client_id, message_t *msg, void *arg)
+{
+  uint32_t seq = 0;
+
+  assert(0 == atomic_fetch_add(&in_handler[client_id], 1));
+
+  memcpy(&seq, msg->data, sizeof(seq));
+  assert(seq == next_seq[client_id]);
+  next_seq[client_id]++;
+  delete_message(msg);
+
+  atomic_fetch_sub(&in_handler[client_id], 1);
+  atomic_fetch_add(&handled, 1);
+}
+
+/*
+* NAME :        busy_fcn
+*
+* DESCRIPTION : Sends every message back to its own client, so the client
+*               always has a message queued until busy_stop is set
+*
+* INPUTS :      client_id - ID of endpoint
+*               msg - Received message
+*               arg - Not used
+*
+* OUTPUTS :     None
+*
+*/
+static void busy_fcn(uint8_t client_id, message_t *msg, void *arg)
+{
+  atomic_fetch_add(&busy_handled, 1);
+  if (atomic_load(&busy_stop))
+  {
+    delete_message(msg);
+    atomic_store(&busy_done, 1);
+    return;
+  }
+
+  assert(0 == send(client_id, msg));
+}
+
+/*
+* NAME :        quiet_fcn
+*
+* DESCRIPTION : Counts the messages of the quiet client
+*
+* INPUTS :      client_id - ID of endpoint
+*               msg - Received message
+*               arg - Not used
+*
+* OUTPUTS :     None
+*
+*/
+static void quiet_fcn(uint8_t client_id, message_t *msg, void *arg)
+{
+  delete_message(msg);
+  atomic_fetch_add(&quiet_handled, 1);
+}
+
+/*
+* NAME :        cycle_sender
+*
+* DESCRIPTION : Sends NUM_CYCLE_MSG more messages to every endpoint, going
+*               on while the workers are stopped and started
+*
+* INPUTS :      arg - Not used
+*
+* OUTPUTS :     None
+*
+*/
+static void * cycle_sender(void *arg)
+{
+  uint32_t base = NUM_EP * NUM_MSG_PER_EP;
+  message_t *msg = NULL;
+
+  for (uint32_t n = 0; n < NUM_CYCLE_MSG; n++)
+  {
+    uint32_t seq = NUM_MSG_PER_EP + n;
+
+    for (uint32_t i = 0; i < NUM_EP; i++)
+    {
+      while (base + n * NUM_EP + i - atomic_load(&handled) >= MAX_IN_FLIGHT)
+      {
+        sched_yield();
+      }
+      msg = new_message();
+      assert(msg);
+      memcpy(msg->data, &seq, sizeof(seq));
+      msg->len = sizeof(seq);
+      assert(0 == send(i, msg));
+    }
+  }
+
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  message_t *msg = NULL;
+  pthread_t sender;
+
+  printf("Testing dispatcher_register");
+  assert(-1 == dispatcher_register(0, NULL, NULL));
+  for (uint32_t i = 0; i < NUM_EP; i++)
+  {
+    assert(0 == dispatcher_register(i, handler_fcn, NULL));
+  }
+  printf("... PASSED\n");
+
+  printf("Testing dispatcher_start");
+  assert(-1 == dispatcher_start(0));
+  assert(-1 == dispatcher_start(DISPATCHER_MAX_WORKERS + 1));
+  assert(0 == dispatcher_start(NUM_WORKERS));
+  printf("... PASSED\n");
+
+  /* Interleave messages of all endpoints, keeping fewer messages in flight
+  * than the message pool holds.
+  */
+  printf("Testing in-order delivery with %d workers and %d endpoints", NUM_WORKERS, NUM_EP);
+  for (uint32_t seq = 0; seq < NUM_MSG_PER_EP; seq++)
+  {
+    for (uint32_t i = 0; i < NUM_EP; i++)
+    {
+      while (seq * NUM_EP + i - atomic_load(&handled) >= MAX_IN_FLIGHT)
+      {
+        sched_yield();
+      }
+      msg = new_message();
+      assert(msg);
+      memcpy(msg->data, &seq, sizeof(seq));
+      msg->len = sizeof(seq);
+      assert(0 == send(i, msg));
+    }
+  }
+
+  while (atomic_load(&handled) != NUM_EP * NUM_MSG_PER_EP)
+  {
+    sched_yield();
+  }
+
+  for (uint32_t i = 0; i < NUM_EP; i++)
+  {
+    assert(NUM_MSG_PER_EP == next_seq[i]);
+  }
+  printf("... PASSED\n");
+
+  dispatcher_stop();
+  printf("Testing dispatcher_stop... PASSED\n");
+
+  /* With one worker, a client that is never idle must not keep another
+  * client off the run queue.
+  */
+  printf("Testing fairness between a busy and a quiet client");
+  assert(0 == dispatcher_register(BUSY_ID, busy_fcn, NULL));
+  assert(0 == dispatcher_register(QUIET_ID, quiet_fcn, NULL));
+  assert(0 == dispatcher_start(1));
+  assert(0 == send(BUSY_ID, new_message()));
+  while (atomic_load(&busy_handled) < 4 * DISPATCHER_BATCH)
+  {
+    usleep(1000);
+  }
+
+  assert(0 == send(QUIET_ID, new_message()));
+  for (uint32_t ms = 0; ms < FAIR_TIMEOUT_MS && !atomic_load(&quiet_handled); ms++)
+  {
+    usleep(1000);
+  }
+  assert(1 == atomic_load(&quiet_handled));
+
+  atomic_store(&busy_stop, 1);
+  while (!atomic_load(&busy_done))
+  {
+    usleep(1000);
+  }
+  dispatcher_stop();
+  printf("... PASSED\n");
+
+  /* Clients queued when the workers stop must be scheduled again by the
+  * next start, and senders must not see workers going away.
+  */
+  printf("Testing dispatcher_stop and dispatcher_start while sending");
+  assert(0 == pthread_create(&sender, NULL, cycle_sender, NULL));
+  for (uint32_t c = 0; c < NUM_CYCLES; c++)
+  {
+    assert(0 == dispatcher_start(NUM_WORKERS));
+    usleep(500);
+    dispatcher_stop();
+  }
+  assert(0 == dispatcher_start(NUM_WORKERS));
+  pthread_join(sender, NULL);
+  while (atomic_load(&handled) != NUM_EP * (NUM_MSG_PER_EP + NUM_CYCLE_MSG))
+  {
+    sched_yield();
+  }
+  dispatcher_stop();
+
+  for (uint32_t i = 0; i < NUM_EP; i++)
+  {
+    assert(NUM_MSG_PER_EP + NUM_CYCLE_MSG == next_seq[i]);
+  }
+  printf("... PASSED\n");
+
+  return 0;
+}
@@ -0,0 +1,788 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+#define SUCCESS 0
+#define ERROR -1
+
+#define JREC_ALIGN(len) (((len) + 7u) & ~7u)
+
+/* CRC-32 (IEEE 802.3, reflected) lookup table, built once */
+static uint32_t jrec_crc_table[256];
+static pthread_once_t jrec_crc_once = PTHREAD_ONCE_INIT;
+
+/*
+* NAME :        jrec_crc_init
+*
+* DESCRIPTION : Builds the CRC-32 lookup table
+*
+* INPUTS :      None
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API, run once through pthread_once.
+*/
+static void jrec_crc_init(
+  void)
+{
+  uint32_t crc = 0;
+
+  for (uint32_t i = 0; i < 256; i++)
+  {
+    crc = i;
+    for (uint32_t bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+    }
+    jrec_crc_table[i] = crc;
+  }
+}
+
+/*
+* NAME :        jrec_crc
+*
+* DESCRIPTION : Adds bytes to a running CRC-32
+*
+* INPUTS :      crc - running value, start with JREC_CRC_INIT
+*               data - bytes
+*               len - number of bytes
+*
+* OUTPUTS :     Running value, invert it to get the CRC
+*
+* NOTES :       It is a static API
+*/
+#define JREC_CRC_INIT 0xFFFFFFFFu
+
+static uint32_t jrec_crc(
+  uint32_t crc,
+  const uint8_t *data,
+  uint32_t len)
+{
+  pthread_once(&jrec_crc_once, jrec_crc_init);
+  for (uint32_t i = 0; i < len; i++)
+  {
+    crc = jrec_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+/*
+* NAME :        jseg_create
+*
+* DESCRIPTION : Creates, sizes and maps a new segment file
+*
+* INPUTS :      jp - journal
+*               idx - segment index, part of the file name
+*
+* OUTPUTS :     Segment or NULL on failure
+*
+* NOTES :       It is a static API. The file blocks are allocated and the
+*               pages populated here, so appending never faults to disk.
+*/
+static struct jseg_s * jseg_create(
+  journal_t *jp,
+  uint32_t idx)
+{
+  char path[JOURNAL_PATH_MAX + 32];
+  struct jseg_s *segp = (struct jseg_s *) calloc(1, sizeof(struct jseg_s));
+
+  if (!segp)
+  {
+    return NULL;
+  }
+
+  segp->idx = idx;
+  snprintf(path, sizeof(path), "%s/journal-%08u.log", jp->dir, idx);
+  segp->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (segp->fd < 0)
+  {
+    printf("%s - Error: Cannot create %s.\n", __func__, path);
+    free(segp);
+    return NULL;
+  }
+
+  if (posix_fallocate(segp->fd, 0, jp->segsize) != SUCCESS)
+  {
+    printf("%s - Error: Cannot allocate %s.\n", __func__, path);
+    close(segp->fd);
+    free(segp);
+    return NULL;
+  }
+
+  segp->basep = (uint8_t *) mmap(NULL, jp->segsize, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, segp->fd, 0);
+  if (MAP_FAILED == segp->basep)
+  {
+    printf("%s - Error: Cannot map %s.\n", __func__, path);
+    close(segp->fd);
+    free(segp);
+    return NULL;
+  }
+
+  return segp;
+}
+
+/*
+* NAME :        jseg_sync
+*
+* DESCRIPTION : Flushes the unsynced part of a segment to disk
+*
+* INPUTS :      segp - segment
+*               used - flush up to this offset
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API, called without the journal lock.
+*/
+static void jseg_sync(
+  struct jseg_s *segp,
+  uint32_t used)
+{
+  uintptr_t pagesize = (uintptr_t) sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t) (segp->basep + segp->synced) & ~(pagesize - 1);
+
+  if (used > segp->synced)
+  {
+    msync((void *) start, (uintptr_t) (segp->basep + used) - start, MS_SYNC);
+  }
+}
+
+/*
+* NAME :        jseg_free
+*
+* DESCRIPTION : Unmaps and closes a segment
+*
+* INPUTS :      jp - journal
+*               segp - segment
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API
+*/
+static void jseg_free(
+  journal_t *jp,
+  struct jseg_s *segp)
+{
+  munmap(segp->basep, jp->segsize);
+  close(segp->fd);
+  free(segp);
+}
+
+/*
+* NAME :        jseg_discard
+*
+* DESCRIPTION : Frees a segment that holds no records and removes its file
+*
+* INPUTS :      jp - journal
+*               segp - segment
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API
+*/
+static void jseg_discard(
+  journal_t *jp,
+  struct jseg_s *segp)
+{
+  char path[JOURNAL_PATH_MAX + 32];
+
+  snprintf(path, sizeof(path), "%s/journal-%08u.log", jp->dir, segp->idx);
+  jseg_free(jp, segp);
+  unlink(path);
+}
+
+/*
+* NAME :        journal_commit_fcn
+*
+* DESCRIPTION : Commit thread. Every commit_ms, or when a durable sender
+*               asks or an appender takes the spare segment, flushes
+*               everything appended so far with one msync per segment (group
+*               commit) and prepares the next segment.
+*
+* INPUTS :      arg - journal
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API
+*/
+static void * journal_commit_fcn(
+  void *arg)
+{
+  journal_t *jp = (journal_t *) arg;
+  struct jseg_s *curp = NULL;
+  struct jseg_s *retiredp = NULL;
+  struct jseg_s *nextp = NULL;
+  struct jseg_s *sparep = NULL;
+  struct timespec deadline;
+  uint64_t target = 0;
+  uint32_t used = 0;
+  uint32_t spareidx = 0;
+  boolean needspare = FALSE;
+  boolean running = TRUE;
+
+  pthread_mutex_lock(&jp->lock);
+  while (running)
+  {
+    if (jp->running && jp->committed == jp->appended)
+    {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += (long) jp->commit_ms * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&jp->kick, &jp->lock, &deadline);
+    }
+    running = jp->running;
+
+    /* Take a snapshot of the work, then flush without the lock */
+    curp = jp->curp;
+    used = curp ? curp->used : 0;
+    retiredp = jp->retiredp;
+    jp->retiredp = NULL;
+    target = jp->appended;
+    needspare = running && !jp->sparep;
+    if (needspare)
+    {
+      spareidx = jp->segidx++;
+    }
+    pthread_mutex_unlock(&jp->lock);
+
+    for (; retiredp; retiredp = nextp)
+    {
+      nextp = retiredp->nextp;
+      jseg_sync(retiredp, retiredp->used);
+      jseg_free(jp, retiredp);
+    }
+
+    if (curp)
+    {
+      jseg_sync(curp, used);
+    }
+
+    /* Keep a segment ready; appenders never create files. If it cannot be
+    * created, appenders get MSG_FULL, and journal_wait_spare waits, until
+    * the next attempt succeeds.
+    */
+    sparep = needspare ? jseg_create(jp, spareidx) : NULL;
+
+    pthread_mutex_lock(&jp->lock);
+    if (curp && jp->curp == curp)
+    {
+      curp->synced = used;
+    }
+    if (sparep)
+    {
+      jp->sparep = sparep;
+    }
+    jp->committed = target;
+    pthread_cond_broadcast(&jp->done);
+  }
+  pthread_mutex_unlock(&jp->lock);
+
+  return NULL;
+}
+
+/*
+* NAME :        journal_next_index
+*
+* DESCRIPTION : Finds the index following the last segment file of a directory
+*
+* INPUTS :      dir - journal directory
+*
+* OUTPUTS :     Index for a new segment
+*
+* NOTES :       It is a static API
+*/
+static uint32_t journal_next_index(
+  const char *dir)
+{
+  DIR *dirp = opendir(dir);
+  struct dirent *entp = NULL;
+  uint32_t idx = 0;
+  uint32_t next = 0;
+
+  if (!dirp)
+  {
+    return 0;
+  }
+
+  while ((entp = readdir(dirp)) != NULL)
+  {
+    if (1 == sscanf(entp->d_name, "journal-%08u.log", &idx) && idx + 1 > next)
+    {
+      next = idx + 1;
+    }
+  }
+  closedir(dirp);
+
+  return next;
+}
+
+/*
+* NAME :        journal_open
+*
+* DESCRIPTION : Opens a journal and starts its commit thread
+*
+* INPUTS :      jp - journal control block
+*               dir - directory of the segment files, created if missing
+*               segsize - segment file size, 0 for JOURNAL_SEG_SIZE
+*               commit_ms - group commit interval, 0 for JOURNAL_COMMIT_MS
+*
+* OUTPUTS :     TRUE - Success
+*               FALSE - Failed
+*
+* NOTES :       Records are appended to new segment files after the ones
+*               already in dir. The first segment and a spare are created
+*               here; afterwards only the commit thread creates segments.
+*/
+boolean journal_open(
+  journal_t *jp,
+  const char *dir,
+  uint32_t segsize,
+  uint32_t commit_ms)
+{
+  if (!jp || !dir || strlen(dir) >= JOURNAL_PATH_MAX)
+  {
+    printf("%s - Error: Incorrect input parameters.\n", __func__);
+    return FALSE;
+  }
+
+  memset(jp, 0, sizeof(*jp));
+  strcpy(jp->dir, dir);
+  jp->segsize = segsize ? segsize : JOURNAL_SEG_SIZE;
+  jp->commit_ms = commit_ms ? commit_ms : JOURNAL_COMMIT_MS;
+
+  if (mkdir(dir, 0755) != SUCCESS && EEXIST != errno)
+  {
+    printf("%s - Error: Cannot create %s.\n", __func__, dir);
+    return FALSE;
+  }
+
+  jp->segidx = journal_next_index(dir);
+  jp->curp = jseg_create(jp, jp->segidx++);
+  if (!jp->curp)
+  {
+    return FALSE;
+  }
+
+  jp->sparep = jseg_create(jp, jp->segidx++);
+  if (!jp->sparep)
+  {
+    jseg_discard(jp, jp->curp);
+    jp->curp = NULL;
+    return FALSE;
+  }
+
+  pthread_mutex_init(&jp->lock, NULL);
+  pthread_cond_init(&jp->kick, NULL);
+  pthread_cond_init(&jp->done, NULL);
+  jp->running = TRUE;
+
+  if (pthread_create(&jp->tid, NULL, journal_commit_fcn, jp) != SUCCESS)
+  {
+    printf("%s - Error: Cannot create commit thread.\n", __func__);
+    jseg_discard(jp, jp->sparep);
+    jseg_discard(jp, jp->curp);
+    jp->sparep = NULL;
+    jp->curp = NULL;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+* NAME :        journal_close
+*
+* DESCRIPTION : Flushes everything and closes a journal
+*
+* INPUTS :      jp - journal control block
+*
+* OUTPUTS :     None
+*
+* NOTES :       No record may be appended during or after the call.
+*/
+void journal_close(
+  journal_t *jp)
+{
+  if (!jp || !jp->curp)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&jp->lock);
+  jp->running = FALSE;
+  pthread_cond_signal(&jp->kick);
+  pthread_mutex_unlock(&jp->lock);
+  pthread_join(jp->tid, NULL);
+
+  jseg_free(jp, jp->curp);
+  jp->curp = NULL;
+  if (jp->sparep)
+  {
+    jseg_discard(jp, jp->sparep);
+    jp->sparep = NULL;
+  }
+
+  pthread_cond_destroy(&jp->done);
+  pthread_cond_destroy(&jp->kick);
+  pthread_mutex_destroy(&jp->lock);
+}
+
+/*
+* NAME :        journal_append
+*
+* DESCRIPTION : Appends a message to the journal
+*
+* INPUTS :      jp - journal control block
+*               dest - destination client
+*               prio - mailbox lane
+*               msg - message, all blocks of a chain are recorded
+*               lsnp - set to the sequence number to pass to journal_wait,
+*                      may be NULL
+*
+* OUTPUTS :     ERROR - failure
+*               MSG_FULL - The segment is full and the commit thread has not
+*                          prepared the next one yet
+*               SUCCESS - Successful
+*
+* NOTES :       It copies the payload into the mapped segment and returns;
+*               the commit thread writes it to disk later. It never does
+*               file I/O itself.
+*/
+int journal_append(
+  journal_t *jp,
+  uint8_t dest,
+  uint8_t prio,
+  message_t *msg,
+  uint64_t *lsnp)
+{
+  struct jrec_s rec;
+  struct jseg_s *segp = NULL;
+  struct timespec now;
+  message_t *blkp = NULL;
+  uint32_t len = chain_len(msg);
+  uint32_t recsize = sizeof(struct jrec_s) + JREC_ALIGN(len);
+  uint32_t crc = JREC_CRC_INIT;
+  uint8_t *dstp = NULL;
+
+  if (!jp || !msg || recsize > jp->segsize)
+  {
+    printf("%s - Error: Incorrect input parameters.\n", __func__);
+    return ERROR;
+  }
+
+  /* Header and CRC are computed before taking the lock */
+  clock_gettime(CLOCK_REALTIME, &now);
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = JREC_MAGIC;
+  rec.dest = dest;
+  rec.prio = prio;
+  rec.len = len;
+  rec.ts_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+  crc = jrec_crc(crc, (const uint8_t *) &rec, sizeof(rec));
+  for (blkp = msg; blkp; blkp = chain_next(blkp))
+  {
+    crc = jrec_crc(crc, blkp->data, blkp->len);
+  }
+  rec.crc = ~crc;
+
+  pthread_mutex_lock(&jp->lock);
+  segp = jp->curp;
+  if (segp->used + recsize > jp->segsize)
+  {
+    /* Take the spare segment; without one, back off instead of creating
+    * a file on the sender's thread.
+    */
+    if (!jp->sparep)
+    {
+      pthread_cond_signal(&jp->kick);
+      pthread_mutex_unlock(&jp->lock);
+      return MSG_FULL;
+    }
+    jp->curp = jp->sparep;
+    jp->sparep = NULL;
+
+    /* Retire the full segment; the commit thread flushes and unmaps it */
+    segp->nextp = jp->retiredp;
+    jp->retiredp = segp;
+    segp = jp->curp;
+    pthread_cond_signal(&jp->kick);
+  }
+
+  dstp = segp->basep + segp->used;
+  dstp += sizeof(rec);
+  for (; msg; msg = chain_next(msg))
+  {
+    memcpy(dstp, msg->data, msg->len);
+    dstp += msg->len;
+  }
+
+  /* Publish the header last so a reader of the mapping never sees a
+  * partial record. After a crash, writeback may have persisted the header
+  * without the payload; the CRC catches that.
+  */
+  memcpy(segp->basep + segp->used, &rec, sizeof(rec));
+  segp->used += recsize;
+  jp->appended += recsize;
+  if (lsnp)
+  {
+    *lsnp = jp->appended;
+  }
+  pthread_mutex_unlock(&jp->lock);
+
+  return SUCCESS;
+}
+
+/*
+* NAME :        journal_wait
+*
+* DESCRIPTION : Waits until the journal is on disk up to a sequence number
+*
+* INPUTS :      jp - journal control block
+*               lsn - sequence number from journal_append
+*
+* OUTPUTS :     ERROR - failure, or the journal stopped before the record
+*                       was on disk
+*               SUCCESS - Successful
+*
+* NOTES :       It wakes the commit thread instead of waiting for the
+*               next interval. Concurrent waiters share one msync.
+*/
+int journal_wait(
+  journal_t *jp,
+  uint64_t lsn)
+{
+  int res = SUCCESS;
+
+  if (!jp)
+  {
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&jp->lock);
+  while (jp->committed < lsn && jp->running)
+  {
+    pthread_cond_signal(&jp->kick);
+    pthread_cond_wait(&jp->done, &jp->lock);
+  }
+  if (jp->committed < lsn)
+  {
+    res = ERROR;
+  }
+  pthread_mutex_unlock(&jp->lock);
+
+  return res;
+}
+
+/*
+* NAME :        journal_wait_spare
+*
+* DESCRIPTION : Waits until the commit thread has a segment ready
+*
+* INPUTS :      jp - journal control block
+*
+* OUTPUTS :     ERROR - failure, or the journal stopped
+*               SUCCESS - A segment is ready
+*
+* NOTES :       Call it after journal_append returned MSG_FULL, then append
+*               again; another sender may have taken the segment. While the
+*               segment cannot be created, the commit thread tries again
+*               every commit interval.
+*/
+int journal_wait_spare(
+  journal_t *jp)
+{
+  int res = SUCCESS;
+
+  if (!jp)
+  {
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&jp->lock);
+  pthread_cond_signal(&jp->kick);
+  while (!jp->sparep && jp->running)
+  {
+    pthread_cond_wait(&jp->done, &jp->lock);
+  }
+  if (!jp->sparep)
+  {
+    res = ERROR;
+  }
+  pthread_mutex_unlock(&jp->lock);
+
+  return res;
+}
+
+/*
+* NAME :        journal_read
+*
+* DESCRIPTION : Calls fn for every record of a journal, oldest first
+*
+* INPUTS :      dir - journal directory
+*               fn - record callback
+*               arg - argument passed to fn
+*
+* OUTPUTS :     ERROR - failure
+*               Number of records read
+*
+* NOTES :       Segments are read through read-only mappings. A segment
+*               ends at the first header without JREC_MAGIC. Reading stops
+*               at the first record whose length or CRC is wrong, such as a
+*               record torn by a crash.
+*/
+int journal_read(
+  const char *dir,
+  journal_rec_fn fn,
+  void *arg)
+{
+  char path[JOURNAL_PATH_MAX + 32];
+  struct jrec_s rec;
+  struct stat st;
+  uint32_t last = 0;
+  uint32_t crc = 0;
+  uint8_t *basep = NULL;
+  uint64_t off = 0;
+  boolean torn = FALSE;
+  int count = 0;
+  int fd = -1;
+
+  if (!dir || !fn)
+  {
+    return ERROR;
+  }
+
+  last = journal_next_index(dir);
+  for (uint32_t idx = 0; idx < last && !torn; idx++)
+  {
+    snprintf(path, sizeof(path), "%s/journal-%08u.log", dir, idx);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+      continue;
+    }
+
+    if (fstat(fd, &st) != SUCCESS || st.st_size < (off_t) sizeof(rec))
+    {
+      close(fd);
+      continue;
+    }
+
+    basep = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == basep)
+    {
+      close(fd);
+      return ERROR;
+    }
+
+    for (off = 0; off + sizeof(rec) <= (uint64_t) st.st_size; )
+    {
+      memcpy(&rec, basep + off, sizeof(rec));
+      if (JREC_MAGIC != rec.magic)
+      {
+        break;
+      }
+
+      torn = off + sizeof(rec) + rec.len > (uint64_t) st.st_size;
+      if (!torn)
+      {
+        crc = rec.crc;
+        rec.crc = 0;
+        torn = crc != ~jrec_crc(jrec_crc(JREC_CRC_INIT, (const uint8_t *) &rec, sizeof(rec)),
+                                basep + off + sizeof(rec), rec.len);
+        rec.crc = crc;
+      }
+      if (torn)
+      {
+        printf("%s - Error: Bad record in %s at %llu.\n", __func__, path,
+               (unsigned long long) off);
+        break;
+      }
+
+      fn(&rec, basep + off + sizeof(rec), arg);
+      count++;
+      off += sizeof(rec) + JREC_ALIGN(rec.len);
+    }
+
+    munmap(basep, st.st_size);
+    close(fd);
+  }
+
+  return count;
+}
+
+/*
+* NAME :        replay_fcn
+*
+* DESCRIPTION : Sends one journal record to its destination client
+*
+* INPUTS :      recp - record header
+*               payload - record payload
+*               arg - counter of replayed messages
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API
+*/
+static void replay_fcn(
+  const struct jrec_s *recp,
+  const uint8_t *payload,
+  void *arg)
+{
+  message_t *msg = NULL;
+
+  if (SUCCESS != chain_append(&msg, payload, recp->len))
+  {
+    printf("%s - Error: No message for record.\n", __func__);
+    return;
+  }
+
+  if (SUCCESS != send_prio(recp->dest, msg, recp->prio))
+  {
+    delete_message(msg);
+    return;
+  }
+
+  (*(uint64_t *) arg)++;
+}
+
+/*
+* NAME :        journal_replay
+*
+* DESCRIPTION : Sends every message of a journal again to its client
+*
+* INPUTS :      dir - journal directory
+*               countp - set to the number of messages delivered, may be NULL
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       Destination clients must be registered. Messages are sent
+*               back to back; with MSG_POLICY_BLOCK the replay runs at the
+*               speed of the receivers. Replay before attaching a journal
+*               with message_set_journal, or the messages are recorded again.
+*/
+int journal_replay(
+  const char *dir,
+  uint64_t *countp)
+{
+  uint64_t count = 0;
+  int res = journal_read(dir, replay_fcn, &count);
+
+  if (countp)
+  {
+    *countp = count;
+  }
+
+  return res < 0 ? ERROR : SUCCESS;
+}
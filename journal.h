@@ -0,0 +1,149 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <stdint.h>
+#include <pthread.h>
+
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Default segment file size and group commit interval */
+#define JOURNAL_SEG_SIZE (4 * 1024 * 1024)
+#define JOURNAL_COMMIT_MS 10
+
+#define JOURNAL_PATH_MAX 256
+
+/*
+* NAME :        jrec_s
+*
+* DESCRIPTION : Record header, followed by len payload bytes padded to 8
+*
+* MEMBERS :     magic - JREC_MAGIC, anything else ends the segment
+*               dest - Destination client
+*               prio - Mailbox lane
+*               len - Payload bytes
+*               ts_ns - Realtime timestamp of the send
+*               crc - CRC-32 of the header, with crc and pad set to 0, and
+*                     of the payload
+*               pad - Always 0
+*
+* NOTES :      None
+*/
+#define JREC_MAGIC 0x4A52
+
+struct jrec_s
+{
+  uint16_t magic;
+  uint8_t dest;
+  uint8_t prio;
+  uint32_t len;
+  uint64_t ts_ns;
+  uint32_t crc;
+  uint32_t pad;
+};
+
+/*
+* NAME :        jseg_s
+*
+* DESCRIPTION : Memory-mapped segment file
+*
+* MEMBERS :     basep - Mapped memory
+*               fd - File descriptor
+*               idx - Index in the file name
+*               used - Bytes appended
+*               synced - Bytes flushed to disk
+*               nextp - Next retired segment
+*
+* NOTES :      None
+*/
+struct jseg_s
+{
+  uint8_t *basep;
+  int fd;
+  uint32_t idx;
+  uint32_t used;
+  uint32_t synced;
+  struct jseg_s *nextp;
+};
+
+/*
+* NAME :        journal_t
+*
+* DESCRIPTION : Journal control block
+*
+* MEMBERS :     dir - Directory of the segment files
+*               segsize - Size of each segment file
+*               commit_ms - Group commit interval
+*               segidx - Index of the next segment file to create
+*               curp - Segment being appended to
+*               sparep - Segment prepared ahead by the commit thread
+*               retiredp - Full segments not yet flushed
+*               appended - Bytes appended since open (log sequence number)
+*               committed - Bytes known to be on disk
+*               lock - Protects the journal
+*               kick - Wakes the commit thread early
+*               done - Signaled when committed advances
+*               tid - Commit thread
+*               running - Commit thread keeps running while TRUE
+*
+* NOTES :      None
+*/
+typedef struct journal_s
+{
+  char dir[JOURNAL_PATH_MAX];
+  uint32_t segsize;
+  uint32_t commit_ms;
+  uint32_t segidx;
+  struct jseg_s *curp;
+  struct jseg_s *sparep;
+  struct jseg_s *retiredp;
+  uint64_t appended;
+  uint64_t committed;
+  pthread_mutex_t lock;
+  pthread_cond_t kick;
+  pthread_cond_t done;
+  pthread_t tid;
+  boolean running;
+} journal_t;
+
+/* Called by journal_read for every record; payload is only valid during the call */
+typedef void (*journal_rec_fn)(const struct jrec_s *recp, const uint8_t *payload, void *arg);
+
+extern boolean journal_open(
+  journal_t *jp,
+  const char *dir,
+  uint32_t segsize,
+  uint32_t commit_ms);
+
+extern void journal_close(
+  journal_t *jp);
+
+extern int journal_append(
+  journal_t *jp,
+  uint8_t dest,
+  uint8_t prio,
+  message_t *msg,
+  uint64_t *lsnp);
+
+extern int journal_wait(
+  journal_t *jp,
+  uint64_t lsn);
+
+extern int journal_wait_spare(
+  journal_t *jp);
+
+extern int journal_read(
+  const char *dir,
+  journal_rec_fn fn,
+  void *arg);
+
+extern int journal_replay(
+  const char *dir,
+  uint64_t *countp);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "message.h"
+#include "journal.h"
+
+#define CLIENT_ID 1
+#define BLOCK_ID 2
+#define POOL_SIZE 256
+#define SEG_SIZE 4096
+#define NUM_MSG 200
+#define CHAIN_LEN 600
+#define LONG_COMMIT_MS 10000
+
+/*
+* NAME :        now_ms
+*
+* DESCRIPTION : Returns the monotonic clock in milliseconds
+*
+* INPUTS :      None
+*
+* OUTPUTS :     Milliseconds
+*
+*/
+static uint64_t now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+* NAME :        seq_len
+*
+* DESCRIPTION : Payload length of the message carrying a sequence number,
+*               varied so records have different sizes
+*
+* INPUTS :      seq - sequence number
+*
+* OUTPUTS :     Payload bytes
+*
+*/
+static uint32_t seq_len(uint32_t seq)
+{
+  return sizeof(seq) + seq % 200;
+}
+
+/*
+* NAME :        seq_message
+*
+* DESCRIPTION : Creates a message carrying a sequence number
+*
+* INPUTS :      seq - sequence number
+*
+* OUTPUTS :     New message
+*
+*/
+static message_t * seq_message(uint32_t seq)
+{
+  message_t *msg = new_message();
+
+  assert(msg);
+  memset(msg->data, (uint8_t) seq, seq_len(seq));
+  memcpy(msg->data, &seq, sizeof(seq));
+  msg->len = seq_len(seq);
+
+  return msg;
+}
+
+/*
+* NAME :        chain_message
+*
+* DESCRIPTION : Creates a chained message of CHAIN_LEN bytes
+*
+* INPUTS :      None
+*
+* OUTPUTS :     New message
+*
+*/
+static message_t * chain_message(void)
+{
+  uint8_t buf[CHAIN_LEN];
+  message_t *msg = NULL;
+
+  for (uint32_t i = 0; i < CHAIN_LEN; i++)
+  {
+    buf[i] = (uint8_t) (i * 3);
+  }
+  assert(0 == chain_append(&msg, buf, CHAIN_LEN));
+
+  return msg;
+}
+
+/*
+* NAME :        check_payload
+*
+* DESCRIPTION : Checks the payload of the n-th message sent by the test
+*
+* INPUTS :      n - position, 0 is the chained message
+*               payload - payload bytes
+*               len - payload length
+*
+* OUTPUTS :     None
+*
+*/
+static void check_payload(uint32_t n, const uint8_t *payload, uint32_t len)
+{
+  uint32_t seq = 0;
+
+  if (0 == n)
+  {
+    assert(CHAIN_LEN == len);
+    for (uint32_t i = 0; i < CHAIN_LEN; i++)
+    {
+      assert((uint8_t) (i * 3) == payload[i]);
+    }
+    return;
+  }
+
+  memcpy(&seq, payload, sizeof(seq));
+  assert(n - 1 == seq);
+  assert(seq_len(seq) == len);
+}
+
+/*
+* NAME :        check_fcn
+*
+* DESCRIPTION : journal_read callback, checks records are in send order
+*
+* INPUTS :      recp - record header
+*               payload - record payload
+*               arg - number of records seen so far
+*
+* OUTPUTS :     None
+*
+*/
+static void check_fcn(const struct jrec_s *recp, const uint8_t *payload, void *arg)
+{
+  uint32_t *countp = (uint32_t *) arg;
+
+  assert(CLIENT_ID == recp->dest);
+  assert((*countp ? MSG_PRIO_DEFAULT : MSG_PRIO_HIGHEST) == recp->prio);
+  check_payload((*countp)++, payload, recp->len);
+}
+
+/*
+* NAME :        count_segments
+*
+* DESCRIPTION : Counts the segment files of a directory
+*
+* INPUTS :      dir - journal directory
+*
+* OUTPUTS :     Number of files
+*
+*/
+static uint32_t count_segments(const char *dir)
+{
+  DIR *dirp = opendir(dir);
+  struct dirent *entp = NULL;
+  uint32_t count = 0;
+
+  assert(dirp);
+  while ((entp = readdir(dirp)) != NULL)
+  {
+    if (0 == strncmp(entp->d_name, "journal-", 8))
+    {
+      count++;
+    }
+  }
+  closedir(dirp);
+
+  return count;
+}
+
+/*
+* NAME :        remove_dir
+*
+* DESCRIPTION : Removes a journal directory and its files
+*
+* INPUTS :      dir - journal directory
+*
+* OUTPUTS :     None
+*
+*/
+static void remove_dir(const char *dir)
+{
+  char path[JOURNAL_PATH_MAX + 32];
+  DIR *dirp = opendir(dir);
+  struct dirent *entp = NULL;
+
+  assert(dirp);
+  while ((entp = readdir(dirp)) != NULL)
+  {
+    if (0 == strncmp(entp->d_name, "journal-", 8))
+    {
+      snprintf(path, sizeof(path), "%s/%s", dir, entp->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dirp);
+  rmdir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+  const msg_client_config_t clients[] = {
+    {CLIENT_ID, POOL_SIZE, MSG_POLICY_FAIL, 0},
+    {BLOCK_ID, POOL_SIZE, MSG_POLICY_BLOCK, 0}
+  };
+  msg_config_t config = {
+    .pool_size = POOL_SIZE,
+    .clientsp = clients,
+    .numclients = 2
+  };
+  char dir[] = "/tmp/journal-test-XXXXXX";
+  char blockdir[] = "/tmp/journal-test-XXXXXX";
+  char path[JOURNAL_PATH_MAX + 32];
+  journal_t journal;
+  struct jrec_s rec;
+  message_t *msg = NULL;
+  uint64_t start = 0;
+  uint64_t replayed = 0;
+  uint32_t count = 0;
+  uint8_t byte = 0;
+  int res = 0;
+  int fd = -1;
+
+  assert(0 == message_service_init(&config));
+  assert(mkdtemp(dir));
+
+  printf("Testing journal_open");
+  assert(FALSE == journal_open(NULL, dir, SEG_SIZE, LONG_COMMIT_MS));
+  assert(FALSE == journal_open(&journal, NULL, SEG_SIZE, LONG_COMMIT_MS));
+  assert(-1 == journal_read(NULL, check_fcn, &count));
+  assert(-1 == journal_read(dir, NULL, NULL));
+  assert(TRUE == journal_open(&journal, dir, SEG_SIZE, LONG_COMMIT_MS));
+  assert(2 == count_segments(dir));
+  printf("... PASSED\n");
+
+  /* The commit interval is long, so only the durable send flushes */
+  printf("Testing send_durable");
+  msg = chain_message();
+  assert(-1 == send_durable(CLIENT_ID, msg, MSG_PRIO_HIGHEST));
+  message_set_journal(&journal);
+  start = now_ms();
+  assert(0 == send_durable(CLIENT_ID, msg, MSG_PRIO_HIGHEST));
+  assert(now_ms() - start < LONG_COMMIT_MS / 2);
+  pthread_mutex_lock(&journal.lock);
+  assert(journal.appended && journal.committed == journal.appended);
+  pthread_mutex_unlock(&journal.lock);
+  printf("... PASSED\n");
+
+  /* Senders back off with MSG_FULL until the next segment is ready */
+  printf("Testing segment rollover");
+  for (uint32_t seq = 0; seq < NUM_MSG; seq++)
+  {
+    msg = seq_message(seq);
+    while (MSG_FULL == (res = send(CLIENT_ID, msg)))
+    {
+      usleep(1000);
+    }
+    assert(0 == res);
+  }
+  message_set_journal(NULL);
+  journal_close(&journal);
+  assert(count_segments(dir) > 3);
+  printf("... PASSED\n");
+
+  printf("Testing journal_read");
+  count = 0;
+  assert(NUM_MSG + 1 == journal_read(dir, check_fcn, &count));
+  assert(NUM_MSG + 1 == count);
+  printf("... PASSED\n");
+
+  /* Empty the mailbox, then get everything back from the journal */
+  printf("Testing journal_replay");
+  while (0 == try_recv(CLIENT_ID, &msg))
+  {
+    delete_message(msg);
+  }
+  assert(0 == journal_replay(dir, &replayed));
+  assert(NUM_MSG + 1 == replayed);
+  for (uint32_t n = 0; n <= NUM_MSG; n++)
+  {
+    uint8_t buf[CHAIN_LEN];
+
+    assert(0 == try_recv(CLIENT_ID, &msg));
+    check_payload(n, buf, chain_copy(msg, buf, sizeof(buf)));
+    delete_message(msg);
+  }
+  assert(MSG_EMPTY == try_recv(CLIENT_ID, &msg));
+  printf("... PASSED\n");
+
+  /* Damage the payload of the second record, as if a crash had written its
+  * header but not its payload; reading stops before it.
+  */
+  printf("Testing torn record");
+  snprintf(path, sizeof(path), "%s/journal-%08u.log", dir, 0);
+  fd = open(path, O_RDWR);
+  assert(fd >= 0);
+  assert(sizeof(rec) == pread(fd, &rec, sizeof(rec), 0));
+  assert(JREC_MAGIC == rec.magic && CHAIN_LEN == rec.len);
+  res = sizeof(rec) + ((CHAIN_LEN + 7) & ~7) + sizeof(rec);
+  assert(1 == pread(fd, &byte, 1, res));
+  byte++;
+  assert(1 == pwrite(fd, &byte, 1, res));
+  close(fd);
+  count = 0;
+  assert(1 == journal_read(dir, check_fcn, &count));
+  printf("... PASSED\n");
+
+  remove_dir(dir);
+
+  /* A blocking sender waits for the next segment instead of failing */
+  printf("Testing blocking send across segments");
+  assert(mkdtemp(blockdir));
+  assert(TRUE == journal_open(&journal, blockdir, SEG_SIZE, LONG_COMMIT_MS));
+  message_set_journal(&journal);
+  for (uint32_t seq = 0; seq < NUM_MSG; seq++)
+  {
+    assert(0 == send(BLOCK_ID, seq_message(seq)));
+    assert(0 == try_recv(BLOCK_ID, &msg));
+    delete_message(msg);
+  }
+  assert(count_segments(blockdir) > 3);
+  printf("... PASSED\n");
+
+  /* Stop the commit thread as journal_close does; a record it has not
+  * synced must not be reported on disk.
+  */
+  printf("Testing journal_wait after the journal stopped");
+  message_set_journal(NULL);
+  pthread_mutex_lock(&journal.lock);
+  journal.running = FALSE;
+  pthread_cond_signal(&journal.kick);
+  pthread_mutex_unlock(&journal.lock);
+  assert(-1 == journal_wait(&journal, journal.appended + 1));
+  journal_close(&journal);
+  printf("... PASSED\n");
+
+  remove_dir(blockdir);
+
+  return 0;
+}
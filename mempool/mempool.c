@@ -1,9 +1,230 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
 
 #include "mempool.h"
 
+/* Shard of the calling thread, 0 until first use */
+static __thread uint32_t shard_self = 0;
+static uint32_t shard_next = 0;
+
+/*
+* NAME :        mempool_lock
+*
+* DESCRIPTION : Locks the pool
+*
+* INPUTS :      poolp - pointer to pool control block
+*               waitnsp - set to the time waited for the lock in nanoseconds
+*
+* OUTPUTS :     TRUE - The lock was busy
+*               FALSE - The lock was taken at once
+*
+* NOTES :       It is a static API. The uncontended path is a single trylock;
+*               the wait is only timed when the lock is busy.
+*/
+static boolean mempool_lock(
+  mempool_t *poolp,
+  uint64_t *waitnsp)
+{
+  struct timespec start, end;
+
+  *waitnsp = 0;
+  if (pthread_mutex_trylock(&poolp->mutex) == 0)
+  {
+    return FALSE;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&poolp->mutex);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *waitnsp = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000ULL +
+             end.tv_nsec - start.tv_nsec;
+
+  return TRUE;
+}
+
+/*
+* NAME :        mempool_count
+*
+* DESCRIPTION : Adds one operation to the calling thread's counter shard
+*
+* INPUTS :      poolp - pointer to pool control block
+*               offset - offsetof the counter in struct mempool_shard_s
+*               contended - TRUE if the lock was busy
+*               waitns - time waited for the lock
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API, called after the pool is unlocked so the
+*               counters do not lengthen the critical section. Threads
+*               sharing a shard add with relaxed atomics.
+*/
+static void mempool_count(
+  mempool_t *poolp,
+  size_t offset,
+  boolean contended,
+  uint64_t waitns)
+{
+  struct mempool_shard_s *shardp = NULL;
+
+  if (0 == shard_self)
+  {
+    shard_self = __atomic_add_fetch(&shard_next, 1, __ATOMIC_RELAXED);
+  }
+  shardp = &poolp->shard[shard_self % MEMPOOL_NSHARDS];
+
+  __atomic_fetch_add((uint64_t *) ((uint8_t *) shardp + offset), 1, __ATOMIC_RELAXED);
+  if (contended)
+  {
+    __atomic_fetch_add(&shardp->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shardp->waitns, waitns, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+* NAME :        mempool_list_push
+*
+* DESCRIPTION : Puts a block at the head of a block list
+*
+* INPUTS :      headpp - list head
+*               blkp - block
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API
+*/
+static void mempool_list_push(
+  struct mmblockhead_s **headpp,
+  struct mmblockhead_s *blkp)
+{
+  blkp->prevp = NULL;
+  blkp->nextp = *headpp;
+  if (NULL != *headpp)
+  {
+    (*headpp)->prevp = blkp;
+  }
+  *headpp = blkp;
+}
+
+/*
+* NAME :        mempool_list_unlink
+*
+* DESCRIPTION : Removes a block from anywhere in a block list
+*
+* INPUTS :      headpp - list head
+*               blkp - block
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API
+*/
+static void mempool_list_unlink(
+  struct mmblockhead_s **headpp,
+  struct mmblockhead_s *blkp)
+{
+  if (NULL != blkp->prevp)
+  {
+    blkp->prevp->nextp = blkp->nextp;
+  }
+  else
+  {
+    *headpp = blkp->nextp;
+  }
+
+  if (NULL != blkp->nextp)
+  {
+    blkp->nextp->prevp = blkp->prevp;
+  }
+  blkp->prevp = NULL;
+  blkp->nextp = NULL;
+}
+
+/*
+* NAME :        mempool_bm_set / mempool_bm_clear
+*
+* DESCRIPTION : Marks a block free or used in the free block bitmap
+*
+* INPUTS :      poolp - pointer to pool control block
+*               idx - block index
+*
+* OUTPUTS :     None
+*
+* NOTES :       They are static APIs, called with the pool locked. A bit of
+*               an upper level is set while any bit of its word below is.
+*               Only the levels whose word changes between empty and
+*               non-empty are touched.
+*/
+static void mempool_bm_set(
+  mempool_t *poolp,
+  uint32_t idx)
+{
+  uint64_t *wordp = NULL;
+  uint64_t old = 0;
+
+  for (uint32_t level = 0; level < poolp->bmlevels; level++)
+  {
+    wordp = &poolp->bitmapp[poolp->bmoff[level] + idx / 64];
+    old = *wordp;
+    *wordp |= 1ULL << (idx % 64);
+    if (old)
+    {
+      break;
+    }
+    idx /= 64;
+  }
+}
+
+static void mempool_bm_clear(
+  mempool_t *poolp,
+  uint32_t idx)
+{
+  uint64_t *wordp = NULL;
+
+  for (uint32_t level = 0; level < poolp->bmlevels; level++)
+  {
+    wordp = &poolp->bitmapp[poolp->bmoff[level] + idx / 64];
+    *wordp &= ~(1ULL << (idx % 64));
+    if (*wordp)
+    {
+      break;
+    }
+    idx /= 64;
+  }
+}
+
+/*
+* NAME :        mempool_bm_first
+*
+* DESCRIPTION : Finds the free block with the lowest index
+*
+* INPUTS :      poolp - pointer to pool control block
+*
+* OUTPUTS :     Block index, -1 if no block is free
+*
+* NOTES :       It is a static API, called with the pool locked. It walks
+*               down from the top level with one find-first-set per level.
+*/
+static int64_t mempool_bm_first(
+  mempool_t *poolp)
+{
+  uint64_t idx = 0;
+  uint64_t word = 0;
+
+  for (uint32_t level = poolp->bmlevels; level-- > 0; )
+  {
+    word = poolp->bitmapp[poolp->bmoff[level] + idx];
+    if (!word)
+    {
+      return -1;
+    }
+    idx = idx * 64 + __builtin_ctzll(word);
+  }
+
+  return (int64_t) idx;
+}
+
 /*
 * NAME :        mempool_init
 *
@@ -60,22 +281,20 @@ boolean mempool_init(
   poolp->memfreedp = NULL;
   poolp->memusedp = NULL;
   poolp->totalsize = totalmem;
+  poolp->numused = 0;
+  poolp->peakused = 0;
+  poolp->policy = MEMPOOL_POLICY_LIFO;
+  poolp->bitmapp = NULL;
+  poolp->bmlevels = 0;
+  memset(poolp->shard, 0, sizeof(poolp->shard));
 
   /* Initialize blocks */
   for( uint32_t i = 0; i < num_blocks; i++)
   {
     cur_blkp = (struct mmblockhead_s *) (poolp->membasep + i * (block_size + headsize));
 
-    cur_blkp->prevp = NULL;
-    cur_blkp->nextp = poolp->memfreedp;
     cur_blkp->used = FALSE;
-
-    if ( NULL != poolp->memfreedp)
-    {
-      poolp->memfreedp->prevp = cur_blkp;
-    }
-
-    poolp->memfreedp = cur_blkp;
+    mempool_list_push(&poolp->memfreedp, cur_blkp);
   }
 
   poolp->poolinited = TRUE;
@@ -109,6 +328,9 @@ void mempool_destroy(
   {
     free(poolp->membasep);
     poolp->membasep = NULL;
+    free(poolp->bitmapp);
+    poolp->bitmapp = NULL;
+    poolp->bmlevels = 0;
   }
   poolp->objsize = 0;
   poolp->blksize = 0;
@@ -123,6 +345,73 @@ void mempool_destroy(
   pthread_mutex_destroy(&poolp->mutex);
 }
 
+/*
+* NAME :        mempool_set_policy
+*
+* DESCRIPTION : Selects which free block mempool_alloc returns
+*
+* INPUTS :      poolp - pointer to pool control block
+*               policy - MEMPOOL_POLICY_LIFO or MEMPOOL_POLICY_LOWADDR
+*
+* OUTPUTS :     TRUE - Success
+*               FALSE - Failed
+*
+* NOTES :       It may be called while blocks are in use; the bitmap is
+*               built from the blocks' used flags.
+*/
+boolean mempool_set_policy(
+  mempool_t *poolp,
+  mempool_policy_t policy)
+{
+  uint64_t *bitmapp = NULL;
+  uint32_t words = 0;
+  uint32_t total = 0;
+  uint32_t levels = 0;
+  uint32_t off[MEMPOOL_BM_LEVELS];
+  struct mmblockhead_s *blkp = NULL;
+
+  if (!poolp || !poolp->poolinited ||
+      (MEMPOOL_POLICY_LIFO != policy && MEMPOOL_POLICY_LOWADDR != policy))
+  {
+    printf("%s - Error: Incorrect input parameters.\n", __func__);
+    return FALSE;
+  }
+
+  /* Size the levels, from one bit per block up to a single word */
+  if (MEMPOOL_POLICY_LOWADDR == policy)
+  {
+    words = poolp->numblk;
+    do
+    {
+      words = (words + 63) / 64;
+      off[levels++] = total;
+      total += words;
+    } while (words > 1);
+
+    bitmapp = (uint64_t *) calloc(total, sizeof(uint64_t));
+    if (!bitmapp)
+    {
+      printf("%s - Error: Cannot allocate memory.\n", __func__);
+      return FALSE;
+    }
+  }
+
+  pthread_mutex_lock(&poolp->mutex);
+  free(poolp->bitmapp);
+  poolp->bitmapp = bitmapp;
+  poolp->bmlevels = levels;
+  memcpy(poolp->bmoff, off, levels * sizeof(off[0]));
+  poolp->policy = policy;
+
+  for (blkp = poolp->memfreedp; bitmapp && blkp; blkp = blkp->nextp)
+  {
+    mempool_bm_set(poolp, ((uint8_t *) blkp - poolp->membasep) / poolp->blksize);
+  }
+  pthread_mutex_unlock(&poolp->mutex);
+
+  return TRUE;
+}
+
 /*
 * NAME :        mempool_alloc
 *
@@ -139,6 +428,8 @@ void * mempool_alloc(
 {
   struct mmblockhead_s *cur_blkp = NULL;
   void *res = NULL;
+  uint64_t waitns = 0;
+  boolean contended = FALSE;
 
   if (!poolp)
   {
@@ -147,12 +438,19 @@ void * mempool_alloc(
   }
 
   /* If pool initialized, get a block from memfreed */
-  pthread_mutex_lock(&poolp->mutex);
+  contended = mempool_lock(poolp, &waitns);
   if (poolp->poolinited)
   {
 
-    /* Point to the first block in free list */
+    /* Point to the first block in free list, or to the lowest free block */
     cur_blkp = poolp->memfreedp;
+    if (cur_blkp && MEMPOOL_POLICY_LOWADDR == poolp->policy)
+    {
+      cur_blkp = (struct mmblockhead_s *) (poolp->membasep +
+                 (uint64_t) mempool_bm_first(poolp) * poolp->blksize);
+      mempool_bm_clear(poolp, ((uint8_t *) cur_blkp - poolp->membasep) /
+                              poolp->blksize);
+    }
 
     /* If there is a free block , move the block to used list.
      * Set linked list parameters for memusedp. The pool will be placed at the
@@ -160,22 +458,19 @@ void * mempool_alloc(
      */
     if (cur_blkp)
     {
-      poolp->memfreedp = poolp->memfreedp->nextp;
-
-      if (poolp->memfreedp)
-      {
-        poolp->memfreedp->prevp = NULL;
-      }
-
-      cur_blkp->prevp = NULL;
-      cur_blkp->nextp = poolp->memusedp;
+      mempool_list_unlink(&poolp->memfreedp, cur_blkp);
       cur_blkp->used = TRUE;
-      poolp->memusedp = cur_blkp;
+      mempool_list_push(&poolp->memusedp, cur_blkp);
 
       /* Pass the address of block.
        * Available memory region starts after the block's header.
        */
       res = (void *) ((void *) cur_blkp + sizeof(struct mmblockhead_s));
+
+      if (++poolp->numused > poolp->peakused)
+      {
+        poolp->peakused = poolp->numused;
+      }
     }
     else
     {
@@ -183,7 +478,11 @@ void * mempool_alloc(
     }
   }
   pthread_mutex_unlock(&poolp->mutex);
-  
+
+  mempool_count(poolp, res ? offsetof(struct mempool_shard_s, allocs) :
+                             offsetof(struct mempool_shard_s, failures),
+                contended, waitns);
+
   return res;
 }
 
@@ -233,6 +532,56 @@ boolean mempool_is_mem_valid(
 
 }
 
+/*
+* NAME :        mempool_blk_index
+*
+* DESCRIPTION : Returns the index of a block in the pool
+*
+* INPUTS :      poolp - pointer to pool control block
+*               memp - memory returned by mempool_alloc
+*
+* OUTPUTS :     Block index, -1 if memory does not belong to the pool
+*
+* NOTES :       Used by tracing to identify blocks.
+*/
+int32_t mempool_blk_index(
+  mempool_t *poolp,
+  void *memp)
+{
+  if (!mempool_is_mem_valid(poolp, memp))
+  {
+    return -1;
+  }
+
+  return (int32_t) (((uint8_t *) memp - sizeof(struct mmblockhead_s) -
+                     poolp->membasep) / poolp->blksize);
+}
+
+/*
+* NAME :        mempool_blk_addr
+*
+* DESCRIPTION : Returns the user memory of a block by its index
+*
+* INPUTS :      poolp - pointer to pool control block
+*               idx - block index from mempool_blk_index
+*
+* OUTPUTS :     Block memory, NULL if the index is out of range
+*
+* NOTES :       The block may be free; callers keep their own validity check.
+*/
+void *mempool_blk_addr(
+  mempool_t *poolp,
+  uint32_t idx)
+{
+  if (!poolp || !poolp->poolinited || idx >= poolp->numblk)
+  {
+    return NULL;
+  }
+
+  return poolp->membasep + (size_t) idx * poolp->blksize +
+         sizeof(struct mmblockhead_s);
+}
+
 /*
 * NAME :        mempool_rel
 *
@@ -252,6 +601,8 @@ boolean mempool_rel(
 {
   struct mmblockhead_s *cur_blkp = NULL;
   boolean res = FALSE;
+  boolean contended = FALSE;
+  uint64_t waitns = 0;
 
   if (!poolp || !memp)
   {
@@ -282,7 +633,7 @@ boolean mempool_rel(
   }
 
 
-  pthread_mutex_lock(&poolp->mutex);
+  contended = mempool_lock(poolp, &waitns);
   do
   {
     if (NULL == cur_blkp ||
@@ -291,39 +642,28 @@ boolean mempool_rel(
       break;
     }
 
-    /* Set next and previous accordingly */
-    if (NULL != cur_blkp->prevp)
-    {
-      /* This is a node in the middle */
-      cur_blkp->prevp->nextp = cur_blkp->nextp;
-      cur_blkp->nextp->prevp = cur_blkp->prevp;
-    }
-    else
-    {
-      /* This the head node */
-      poolp->memusedp = cur_blkp->nextp;
-      if (NULL != poolp->memusedp)
-      {
-        poolp->memusedp->prevp = NULL;
-      }
-    }
-
-    /* Add the block to the freed list */
-    cur_blkp->prevp = NULL;
-    cur_blkp->nextp = poolp->memfreedp;
+    /* Move the block from the used list to the freed list */
+    mempool_list_unlink(&poolp->memusedp, cur_blkp);
     cur_blkp->used = FALSE;
-    if ( NULL != poolp->memfreedp)
+    mempool_list_push(&poolp->memfreedp, cur_blkp);
+    if (MEMPOOL_POLICY_LOWADDR == poolp->policy)
     {
-      poolp->memfreedp->prevp = cur_blkp;
+      mempool_bm_set(poolp, ((uint8_t *) cur_blkp - poolp->membasep) /
+                            poolp->blksize);
     }
-    poolp->memfreedp = cur_blkp;
 
     /* Released the memory block successfully */
+    poolp->numused--;
     res = TRUE;
 
   } while(0);
   pthread_mutex_unlock(&poolp->mutex);
 
+  if (res)
+  {
+    mempool_count(poolp, offsetof(struct mempool_shard_s, frees), contended, waitns);
+  }
+
   return res;
 }
 
@@ -344,3 +684,72 @@ void mempool_print_stat(
   printf("pool status: size:%d, numblocks:%d, blocksize:%d, msgsize:%d, mem:%p, memused:%p, memfreed:%p\n",
         poolp->totalsize, poolp->numblk, poolp->blksize, poolp->objsize, poolp->membasep, poolp->memusedp, poolp->memfreedp);
 }
+
+/*
+* NAME :        mempool_get_stat
+*
+* DESCRIPTION : Aggregates the pool counters
+*
+* INPUTS :      poolp - pointer to pool control block
+*               statp - Buffer to fill
+*
+* OUTPUTS :     TRUE - Success
+*               FALSE - Failed
+*
+* NOTES :       It does not take the pool lock. Counters of different shards
+*               may be sampled at slightly different times.
+*/
+boolean mempool_get_stat(
+  mempool_t *poolp,
+  mempool_stat_t *statp)
+{
+  if (!poolp || !statp)
+  {
+    printf("%s - Error: Invalid input parameters.\n", __func__);
+    return FALSE;
+  }
+
+  memset(statp, 0, sizeof(*statp));
+  statp->numblk = poolp->numblk;
+  statp->live = poolp->numused;
+  statp->peak = poolp->peakused;
+  statp->free = statp->numblk - statp->live;
+
+  for (uint32_t i = 0; i < MEMPOOL_NSHARDS; i++)
+  {
+    statp->allocs += __atomic_load_n(&poolp->shard[i].allocs, __ATOMIC_RELAXED);
+    statp->frees += __atomic_load_n(&poolp->shard[i].frees, __ATOMIC_RELAXED);
+    statp->failures += __atomic_load_n(&poolp->shard[i].failures, __ATOMIC_RELAXED);
+    statp->contended += __atomic_load_n(&poolp->shard[i].contended, __ATOMIC_RELAXED);
+    statp->waitns += __atomic_load_n(&poolp->shard[i].waitns, __ATOMIC_RELAXED);
+  }
+
+  return TRUE;
+}
+
+/*
+* NAME :        mempool_dump_stat
+*
+* DESCRIPTION : Writes pool statistics as a JSON object
+*
+* INPUTS :      fp - Output stream
+*               statp - Statistics from mempool_get_stat
+*
+* OUTPUTS :     None
+*
+* NOTES :       No newline is written so the object can be embedded.
+*/
+void mempool_dump_stat(
+  FILE *fp,
+  const mempool_stat_t *statp)
+{
+  fprintf(fp, "{\"numblk\":%u,\"live\":%u,\"peak\":%u,\"free\":%u,"
+          "\"allocs\":%llu,\"frees\":%llu,\"failures\":%llu,"
+          "\"contended\":%llu,\"waitns\":%llu}",
+          statp->numblk, statp->live, statp->peak, statp->free,
+          (unsigned long long) statp->allocs,
+          (unsigned long long) statp->frees,
+          (unsigned long long) statp->failures,
+          (unsigned long long) statp->contended,
+          (unsigned long long) statp->waitns);
+}
@@ -1,13 +1,48 @@
 #ifndef MEMPOOL_H
 #define MEMPOOL_H
+#include <stdio.h>
 #include <stdint.h>
 #include <pthread.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of counter shards per pool. Threads are spread over the shards so
+* that the counters do not add a shared cache line write to alloc/free.
+*/
+#define MEMPOOL_NSHARDS 16
+#define MEMPOOL_CACHELINE 64
+
+/* Levels of the free block bitmap, 64 blocks per bit of the level above.
+* Six levels cover any 32-bit block count.
+*/
+#define MEMPOOL_BM_LEVELS 6
+
 typedef enum {
   FALSE,
   TRUE
 } boolean;
 
+/*
+* NAME :        mempool_policy_t
+*
+* DESCRIPTION : Which free block mempool_alloc returns
+*
+* MEMBERS :     MEMPOOL_POLICY_LIFO - The block released last, O(1)
+*               MEMPOOL_POLICY_LOWADDR - The free block with the lowest
+*                                        address, found in a hierarchical
+*                                        bitmap in O(log64 numblk)
+*
+* NOTES :      LOWADDR keeps live blocks packed at the start of the arena so
+*              they share pages and cache sets and the end of the arena can
+*              go cold.
+*/
+typedef enum {
+  MEMPOOL_POLICY_LIFO,
+  MEMPOOL_POLICY_LOWADDR
+} mempool_policy_t;
+
 /*
 * NAME :        mmblockhead_s
 *
@@ -26,6 +61,30 @@ struct mmblockhead_s
   struct mmblockhead_s *nextp;
 };
 
+/*
+* NAME :        mempool_shard_s
+*
+* DESCRIPTION : Per-thread group of pool counters
+*
+* MEMBERS :     allocs - Successful allocations
+*               frees - Successful releases
+*               failures - Allocations that found the pool empty
+*               contended - Lock acquisitions that had to wait
+*               waitns - Time spent waiting for the lock in nanoseconds
+*
+* NOTES :      Updated with relaxed atomic adds after the pool mutex is
+*              released, read without it. A pool must be 64-byte aligned;
+*              use aligned_alloc or posix_memalign for a heap pool.
+*/
+struct mempool_shard_s
+{
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t failures;
+  uint64_t contended;
+  uint64_t waitns;
+} __attribute__((aligned(MEMPOOL_CACHELINE)));
+
 /*
 * NAME :        mempool_t
 *
@@ -40,6 +99,13 @@ struct mmblockhead_s
 *               numblk - Number of blocks
 *               totalsize - Pool total size
 *               mutex - Locking mechanism
+*               numused - Number of blocks in use
+*               peakused - Highest number of blocks in use
+*               policy - Allocation policy
+*               bitmapp - Free block bitmap of all levels, LOWADDR only
+*               bmlevels - Number of bitmap levels
+*               bmoff[] - Word offset of each level in bitmapp, leaves first
+*               shard[] - Sharded counters
 *
 * NOTES :      None
 */
@@ -54,8 +120,45 @@ typedef struct
   uint32_t numblk;  /* number of blocks in the pool */
   uint32_t totalsize;
   pthread_mutex_t mutex;
+  uint32_t numused;
+  uint32_t peakused;
+  mempool_policy_t policy;
+  uint64_t *bitmapp;
+  uint32_t bmlevels;
+  uint32_t bmoff[MEMPOOL_BM_LEVELS];
+  struct mempool_shard_s shard[MEMPOOL_NSHARDS];
 } mempool_t;
 
+/*
+* NAME :        mempool_stat_t
+*
+* DESCRIPTION : Snapshot of pool statistics
+*
+* MEMBERS :     numblk - Number of blocks in the pool
+*               live - Blocks in use
+*               peak - Highest number of blocks in use
+*               free - Blocks available
+*               allocs - Successful allocations
+*               frees - Successful releases
+*               failures - Allocations that found the pool empty
+*               contended - Lock acquisitions that had to wait
+*               waitns - Time spent waiting for the lock in nanoseconds
+*
+* NOTES :      None
+*/
+typedef struct
+{
+  uint32_t numblk;
+  uint32_t live;
+  uint32_t peak;
+  uint32_t free;
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t failures;
+  uint64_t contended;
+  uint64_t waitns;
+} mempool_stat_t;
+
 
 extern boolean mempool_init(
   mempool_t *poolp,
@@ -64,6 +167,10 @@ extern boolean mempool_init(
 
 extern void mempool_destroy(mempool_t *poolp);
 
+extern boolean mempool_set_policy(
+  mempool_t *poolp,
+  mempool_policy_t policy);
+
 extern void *mempool_alloc(mempool_t *poolp);
 
 extern boolean mempool_rel(
@@ -74,6 +181,26 @@ extern boolean mempool_is_mem_valid(
   mempool_t *poolp,
   void *memp);
 
+extern int32_t mempool_blk_index(
+  mempool_t *poolp,
+  void *memp);
+
+extern void *mempool_blk_addr(
+  mempool_t *poolp,
+  uint32_t idx);
+
 void mempool_print_stat(
   mempool_t *poolp);
+
+extern boolean mempool_get_stat(
+  mempool_t *poolp,
+  mempool_stat_t *statp);
+
+extern void mempool_dump_stat(
+  FILE *fp,
+  const mempool_stat_t *statp);
+
+#ifdef __cplusplus
+}
+#endif
 #endif
\ No newline at end of file
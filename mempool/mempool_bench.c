@@ -0,0 +1,613 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "mempool.h"
+
+#define MAX_THREADS 64
+#define DEFAULT_OPS 200000
+/* One operation in SAMPLE_EVERY is timed for the latency percentiles */
+#define SAMPLE_EVERY 64
+
+/*
+* NAME :        alloc_kind_t / pattern_t
+*
+* DESCRIPTION : Allocator under test and access pattern
+*
+* NOTES :       PAT_PRODCONS allocates on even threads and frees on the
+*               paired odd thread.
+*/
+typedef enum
+{
+  ALLOC_MEMPOOL,
+  ALLOC_MEMPOOL_LOWADDR,
+  ALLOC_MALLOC
+} alloc_kind_t;
+
+typedef enum
+{
+  PAT_LIFO,
+  PAT_FIFO,
+  PAT_RANDOM,
+  PAT_PRODCONS
+} pattern_t;
+
+static const char *alloc_names[] = {"mempool", "mempool-lowaddr", "malloc"};
+static const char *pattern_names[] = {"lifo", "fifo", "random", "prodcons"};
+static const uint32_t block_sizes[] = {16, 64, 256, 1024, 4096};
+static const uint32_t pool_sizes[] = {64, 1024, 16384};
+
+/*
+* NAME :        spsc_s
+*
+* DESCRIPTION : Single producer single consumer ring passing blocks between
+*               a producer and a consumer thread
+*
+* MEMBERS :     head - Next slot to read, written by the consumer
+*               tail - Next slot to write, written by the producer
+*               size - Number of slots
+*               slotp - Slots
+*
+* NOTES :      None
+*/
+struct spsc_s
+{
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  uint32_t size;
+  void **slotp;
+};
+
+/*
+* NAME :        bench_thr_s
+*
+* DESCRIPTION : Results of one benchmark thread
+*
+* MEMBERS :     samplesp - Latency samples in nanoseconds
+*               numsamples - Number of samples
+*               done - Operations completed
+*               startns/endns - When the thread started and finished
+*
+* NOTES :      One cache line per thread, so the counters of different
+*              threads do not share lines.
+*/
+struct bench_thr_s
+{
+  uint32_t *samplesp;
+  uint64_t numsamples;
+  uint64_t done;
+  uint64_t startns;
+  uint64_t endns;
+} __attribute__((aligned(64)));
+
+/*
+* NAME :        bench_s
+*
+* DESCRIPTION : One benchmark run
+*
+* MEMBERS :     kind - Allocator
+*               pattern - Access pattern
+*               blksize - Block size in bytes
+*               poolblk - Number of blocks in the pool, also the total working set
+*               numthr - Number of threads
+*               ops - Operations per thread, an alloc and a free are two
+*               pool - Pool shared by all threads
+*               barrier - Start barrier
+*               ringp - Rings of producer/consumer pairs
+*               thr - Results of each thread
+*
+* NOTES :      None
+*/
+struct bench_s
+{
+  alloc_kind_t kind;
+  pattern_t pattern;
+  uint32_t blksize;
+  uint32_t poolblk;
+  uint32_t numthr;
+  uint64_t ops;
+  mempool_t pool;
+  pthread_barrier_t barrier;
+  struct spsc_s ring[MAX_THREADS / 2];
+  struct bench_thr_s thr[MAX_THREADS];
+};
+
+/*
+* NAME :        thread_arg_s
+*
+* DESCRIPTION : Argument of a benchmark thread
+*
+* MEMBERS :     benchp - Benchmark run
+*               idx - Thread index
+*
+* NOTES :      None
+*/
+struct thread_arg_s
+{
+  struct bench_s *benchp;
+  uint32_t idx;
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *statep)
+{
+  uint64_t x = *statep;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *statep = x;
+  return x;
+}
+
+/*
+* NAME :        bench_alloc / bench_free
+*
+* DESCRIPTION : Allocates or frees one block, timing one call in SAMPLE_EVERY
+*
+* INPUTS :      benchp - Benchmark run
+*               idx - Thread index
+*               opcnt - Operation counter of the thread
+*               memp - Block to free
+*
+* OUTPUTS :     Allocated block
+*
+* NOTES :       The first byte of every allocated block is written so both
+*               allocators hand out memory that is actually touched. The
+*               working sets are sized to fit the pool, so running out of
+*               blocks is a bug of the benchmark and ends it.
+*/
+static void * bench_alloc(
+  struct bench_s *benchp,
+  uint32_t idx,
+  uint64_t *opcnt)
+{
+  uint64_t start = 0;
+  boolean sample = (0 == (++(*opcnt) % SAMPLE_EVERY));
+  void *memp = NULL;
+
+  if (sample)
+  {
+    start = now_ns();
+  }
+
+  if (ALLOC_MALLOC != benchp->kind)
+  {
+    memp = mempool_alloc(&benchp->pool);
+  }
+  else
+  {
+    memp = malloc(benchp->blksize);
+  }
+
+  if (sample)
+  {
+    benchp->thr[idx].samplesp[benchp->thr[idx].numsamples++] = (uint32_t) (now_ns() - start);
+  }
+
+  if (!memp)
+  {
+    printf("%s - Error: No block left, %u blocks shared by %u threads.\n",
+           __func__, benchp->poolblk, benchp->numthr);
+    exit(1);
+  }
+
+  *(volatile uint8_t *) memp = (uint8_t) idx;
+  return memp;
+}
+
+static void bench_free(
+  struct bench_s *benchp,
+  uint32_t idx,
+  uint64_t *opcnt,
+  void *memp)
+{
+  uint64_t start = 0;
+  boolean sample = (0 == (++(*opcnt) % SAMPLE_EVERY));
+
+  if (sample)
+  {
+    start = now_ns();
+  }
+
+  if (ALLOC_MALLOC != benchp->kind)
+  {
+    mempool_rel(&benchp->pool, memp);
+  }
+  else
+  {
+    free(memp);
+  }
+
+  if (sample)
+  {
+    benchp->thr[idx].samplesp[benchp->thr[idx].numsamples++] = (uint32_t) (now_ns() - start);
+  }
+}
+
+/*
+* NAME :        bench_thread_fcn
+*
+* DESCRIPTION : Runs the access pattern of one thread
+*
+* INPUTS :      arg - struct thread_arg_s
+*
+* OUTPUTS :     None
+*
+* NOTES :       In the lifo, fifo and random patterns each thread keeps at
+*               most poolblk / numthr blocks live. A producer/consumer pair
+*               holds its ring plus the block the producer waits to queue
+*               and the one the consumer frees; prodcons_ring_size leaves
+*               room for both.
+*/
+static void * bench_thread_fcn(
+  void *arg)
+{
+  struct thread_arg_s *argp = (struct thread_arg_s *) arg;
+  struct bench_s *benchp = argp->benchp;
+  uint32_t idx = argp->idx;
+  uint32_t wset = benchp->poolblk / benchp->numthr;
+  void **livep = (void **) calloc(wset, sizeof(void *));
+  struct spsc_s *ringp = &benchp->ring[idx / 2];
+  uint64_t rng = 0x9E3779B97F4A7C15ULL ^ (idx + 1);
+  uint64_t opcnt = 0;
+  uint64_t ops = benchp->ops;
+  uint32_t slot = 0;
+
+  pthread_barrier_wait(&benchp->barrier);
+  benchp->thr[idx].startns = now_ns();
+
+  switch (benchp->pattern)
+  {
+    case PAT_LIFO:
+    case PAT_FIFO:
+      while (opcnt < ops)
+      {
+        for (uint32_t i = 0; i < wset; i++)
+        {
+          livep[i] = bench_alloc(benchp, idx, &opcnt);
+        }
+        for (uint32_t i = 0; i < wset; i++)
+        {
+          slot = (PAT_LIFO == benchp->pattern) ? wset - 1 - i : i;
+          bench_free(benchp, idx, &opcnt, livep[slot]);
+        }
+      }
+      break;
+
+    case PAT_RANDOM:
+      while (opcnt < ops)
+      {
+        slot = (uint32_t) (xorshift(&rng) % wset);
+        if (livep[slot])
+        {
+          bench_free(benchp, idx, &opcnt, livep[slot]);
+          livep[slot] = NULL;
+        }
+        else
+        {
+          livep[slot] = bench_alloc(benchp, idx, &opcnt);
+        }
+      }
+      for (uint32_t i = 0; i < wset; i++)
+      {
+        if (livep[i])
+        {
+          bench_free(benchp, idx, &opcnt, livep[i]);
+        }
+      }
+      break;
+
+    case PAT_PRODCONS:
+      /* Even threads allocate, odd threads free what their pair allocated */
+      for (uint64_t n = 0; n < ops / 2; n++)
+      {
+        if (0 == idx % 2)
+        {
+          void *memp = bench_alloc(benchp, idx, &opcnt);
+
+          while (__atomic_load_n(&ringp->tail, __ATOMIC_RELAXED) -
+                 __atomic_load_n(&ringp->head, __ATOMIC_ACQUIRE) >= ringp->size)
+          {
+            sched_yield();
+          }
+          ringp->slotp[ringp->tail % ringp->size] = memp;
+          __atomic_store_n(&ringp->tail, ringp->tail + 1, __ATOMIC_RELEASE);
+        }
+        else
+        {
+          void *memp = NULL;
+
+          while (__atomic_load_n(&ringp->tail, __ATOMIC_ACQUIRE) ==
+                 __atomic_load_n(&ringp->head, __ATOMIC_RELAXED))
+          {
+            sched_yield();
+          }
+          memp = ringp->slotp[ringp->head % ringp->size];
+          __atomic_store_n(&ringp->head, ringp->head + 1, __ATOMIC_RELEASE);
+          bench_free(benchp, idx, &opcnt, memp);
+        }
+      }
+      break;
+  }
+
+  benchp->thr[idx].endns = now_ns();
+  benchp->thr[idx].done = opcnt;
+  free(livep);
+  return NULL;
+}
+
+/*
+* NAME :        prodcons_ring_size
+*
+* DESCRIPTION : Ring size of a producer/consumer pair that keeps all pairs
+*               within the pool
+*
+* INPUTS :      poolblk - Number of blocks in the pool
+*               numthr - Number of threads, even
+*
+* OUTPUTS :     Number of slots, 0 when the pool is too small for the pairs
+*
+* NOTES :       Each pair holds at most its ring plus two blocks.
+*/
+static uint32_t prodcons_ring_size(
+  uint32_t poolblk,
+  uint32_t numthr)
+{
+  if (poolblk <= numthr)
+  {
+    return 0;
+  }
+
+  return (poolblk - numthr) / (numthr / 2);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+* NAME :        bench_run
+*
+* DESCRIPTION : Runs one configuration and prints a result row
+*
+* INPUTS :      benchp - Benchmark run, parameters filled in
+*               json - TRUE for JSON output, FALSE for CSV
+*               first - TRUE for the first row
+*
+* OUTPUTS :     None
+*
+* NOTES :       None
+*/
+static void bench_run(
+  struct bench_s *benchp,
+  boolean json,
+  boolean first)
+{
+  pthread_t tid[MAX_THREADS];
+  struct thread_arg_s args[MAX_THREADS];
+  uint64_t start = UINT64_MAX;
+  uint64_t end = 0;
+  uint64_t elapsed = 0;
+  uint64_t total = 0;
+  uint64_t numsamples = 0;
+  uint32_t *allp = NULL;
+  uint32_t p50 = 0, p99 = 0, p999 = 0;
+  uint32_t numpairs = benchp->numthr / 2;
+
+  if (ALLOC_MALLOC != benchp->kind &&
+      !mempool_init(&benchp->pool, benchp->poolblk, benchp->blksize))
+  {
+    return;
+  }
+  if (ALLOC_MEMPOOL_LOWADDR == benchp->kind)
+  {
+    mempool_set_policy(&benchp->pool, MEMPOOL_POLICY_LOWADDR);
+  }
+
+  for (uint32_t i = 0; i < numpairs; i++)
+  {
+    memset(&benchp->ring[i], 0, sizeof(benchp->ring[i]));
+    benchp->ring[i].size = prodcons_ring_size(benchp->poolblk, benchp->numthr);
+    benchp->ring[i].slotp = (void **) calloc(benchp->ring[i].size, sizeof(void *));
+  }
+
+  for (uint32_t i = 0; i < benchp->numthr; i++)
+  {
+    /* A pattern may finish its last round of poolblk blocks past ops */
+    benchp->thr[i].samplesp = (uint32_t *) malloc(((benchp->ops + 2 * benchp->poolblk) /
+                                               SAMPLE_EVERY + 2) * sizeof(uint32_t));
+    benchp->thr[i].numsamples = 0;
+  }
+
+  pthread_barrier_init(&benchp->barrier, NULL, benchp->numthr);
+  for (uint32_t i = 0; i < benchp->numthr; i++)
+  {
+    args[i].benchp = benchp;
+    args[i].idx = i;
+    pthread_create(&tid[i], NULL, bench_thread_fcn, &args[i]);
+  }
+
+  /* Wall time from the first thread starting to the last one finishing */
+  for (uint32_t i = 0; i < benchp->numthr; i++)
+  {
+    pthread_join(tid[i], NULL);
+    start = benchp->thr[i].startns < start ? benchp->thr[i].startns : start;
+    end = benchp->thr[i].endns > end ? benchp->thr[i].endns : end;
+  }
+  elapsed = end - start;
+  pthread_barrier_destroy(&benchp->barrier);
+
+  /* Merge the samples of all threads */
+  for (uint32_t i = 0; i < benchp->numthr; i++)
+  {
+    numsamples += benchp->thr[i].numsamples;
+  }
+  allp = (uint32_t *) malloc((numsamples + 1) * sizeof(uint32_t));
+  for (uint32_t i = 0; i < benchp->numthr; i++)
+  {
+    memcpy(allp + total, benchp->thr[i].samplesp, benchp->thr[i].numsamples * sizeof(uint32_t));
+    total += benchp->thr[i].numsamples;
+    free(benchp->thr[i].samplesp);
+  }
+  if (numsamples)
+  {
+    qsort(allp, numsamples, sizeof(uint32_t), cmp_u32);
+    p50 = allp[numsamples * 50 / 100];
+    p99 = allp[numsamples * 99 / 100];
+    p999 = allp[numsamples * 999 / 1000];
+  }
+  free(allp);
+
+  total = 0;
+  for (uint32_t i = 0; i < benchp->numthr; i++)
+  {
+    total += benchp->thr[i].done;
+  }
+  if (json)
+  {
+    printf("%s{\"allocator\":\"%s\",\"pattern\":\"%s\",\"block_size\":%u,\"pool_blocks\":%u,"
+           "\"threads\":%u,\"ops\":%llu,\"mops\":%.3f,\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u}",
+           first ? "" : ",\n", alloc_names[benchp->kind], pattern_names[benchp->pattern],
+           benchp->blksize, benchp->poolblk, benchp->numthr, (unsigned long long) total,
+           total * 1000.0 / elapsed, p50, p99, p999);
+  }
+  else
+  {
+    printf("%s,%s,%u,%u,%u,%llu,%.3f,%u,%u,%u\n",
+           alloc_names[benchp->kind], pattern_names[benchp->pattern],
+           benchp->blksize, benchp->poolblk, benchp->numthr, (unsigned long long) total,
+           total * 1000.0 / elapsed, p50, p99, p999);
+  }
+  fflush(stdout);
+
+  for (uint32_t i = 0; i < numpairs; i++)
+  {
+    free(benchp->ring[i].slotp);
+  }
+
+  if (ALLOC_MALLOC != benchp->kind)
+  {
+    mempool_destroy(&benchp->pool);
+  }
+}
+
+static void usage(const char *name)
+{
+  printf("Usage: %s [-j] [-n ops] [-t max_threads]\n"
+         "  -j  JSON output instead of CSV\n"
+         "  -n  operations per thread (default %d)\n"
+         "  -t  maximum number of threads, doubled from 1 (default: online CPUs)\n",
+         name, DEFAULT_OPS);
+}
+
+int main(int argc, char *argv[])
+{
+  struct bench_s *benchp = NULL;
+  boolean json = FALSE;
+  boolean first = TRUE;
+  uint64_t ops = DEFAULT_OPS;
+  long maxthr = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "jn:t:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'j':
+        json = TRUE;
+        break;
+      case 'n':
+        ops = strtoull(optarg, NULL, 10);
+        break;
+      case 't':
+        maxthr = strtol(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  /* The pool and the rings hold cache-line aligned members */
+  if (posix_memalign((void **) &benchp, MEMPOOL_CACHELINE, sizeof(struct bench_s)) != 0)
+  {
+    printf("%s - Error: Cannot allocate benchmark.\n", __func__);
+    return 1;
+  }
+
+  if (maxthr < 1)
+  {
+    maxthr = 1;
+  }
+  if (maxthr > MAX_THREADS)
+  {
+    maxthr = MAX_THREADS;
+  }
+
+  if (json)
+  {
+    printf("[\n");
+  }
+  else
+  {
+    printf("allocator,pattern,block_size,pool_blocks,threads,ops,mops,p50_ns,p99_ns,p999_ns\n");
+  }
+
+  for (uint32_t p = PAT_LIFO; p <= PAT_PRODCONS; p++)
+  {
+    for (uint32_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++)
+    {
+      for (uint32_t s = 0; s < sizeof(pool_sizes) / sizeof(pool_sizes[0]); s++)
+      {
+        for (uint32_t t = 1; t <= (uint32_t) maxthr; t *= 2)
+        {
+          /* Producer/consumer needs pairs with a ring slot each, and every
+          * thread needs a block.
+          */
+          if ((PAT_PRODCONS == p && (t < 2 || 0 == prodcons_ring_size(pool_sizes[s], t))) ||
+              t > pool_sizes[s])
+          {
+            continue;
+          }
+
+          for (uint32_t k = ALLOC_MEMPOOL; k <= ALLOC_MALLOC; k++)
+          {
+            memset(benchp, 0, sizeof(*benchp));
+            benchp->kind = (alloc_kind_t) k;
+            benchp->pattern = (pattern_t) p;
+            benchp->blksize = block_sizes[b];
+            benchp->poolblk = pool_sizes[s];
+            benchp->numthr = t;
+            benchp->ops = ops;
+            bench_run(benchp, json, first);
+            first = FALSE;
+          }
+        }
+      }
+    }
+  }
+
+  if (json)
+  {
+    printf("\n]\n");
+  }
+
+  free(benchp);
+  return 0;
+}
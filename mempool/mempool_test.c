@@ -15,10 +15,16 @@ int main(int argc, char **argv)
   mempool_t tpool = {0};
   mempool_t *dummy_tpool = NULL;
   int num_msg = 10;
-  message_t *msg[num_msg];
+  /* One more slot for the allocation that finds the pool empty */
+  message_t *msg[num_msg + 1];
   int i = 0;
   void *prev_memaddressp = NULL;
   void *dummy_memaddressp = NULL;
+  mempool_stat_t stat;
+  mempool_t lpool = {0};
+  int num_low = 5000;
+  void *lowp[num_low];
+  struct mmblockhead_s *blkp = NULL;
 
   printf("Testing the pool...:\n");
   /* Testing wrong arguments */
@@ -97,6 +103,73 @@ int main(int argc, char **argv)
   }while(i != 0);
   printf("Releasing all messages...PASSED\n");
 
+  printf("Testing mempool_get_stat");
+  assert(FALSE == mempool_get_stat(&tpool, NULL));
+  assert(TRUE == mempool_get_stat(&tpool, &stat));
+  assert(stat.numblk == num_msg);
+  assert(stat.live == 0);
+  assert(stat.free == num_msg);
+  assert(stat.peak == num_msg);
+  assert(stat.allocs == num_msg + 3);
+  assert(stat.frees == stat.allocs);
+  assert(stat.failures == 2);
+  assert(stat.contended == 0);
+  printf("... PASSED\n");
+  mempool_dump_stat(stdout, &stat);
+  printf("\n");
+
+  /* Enough blocks for three bitmap levels */
+  printf("Testing MEMPOOL_POLICY_LOWADDR");
+  assert(FALSE == mempool_set_policy(NULL, MEMPOOL_POLICY_LOWADDR));
+  assert(FALSE == mempool_set_policy(&tpool, (mempool_policy_t) 7));
+  assert(TRUE == mempool_init(&lpool, num_low, sizeof(uint64_t)));
+  assert(TRUE == mempool_set_policy(&lpool, MEMPOOL_POLICY_LOWADDR));
+  for (i = 0; i < num_low; i++)
+  {
+    lowp[i] = mempool_alloc(&lpool);
+    assert(mempool_blk_index(&lpool, lowp[i]) == i);
+  }
+  assert(NULL == mempool_alloc(&lpool));
+
+  /* Free every other block from the top; they come back lowest first */
+  for (i = num_low - 1; i >= 0; i -= 2)
+  {
+    assert(TRUE == mempool_rel(&lpool, lowp[i]));
+  }
+  for (i = 1; i < num_low; i += 2)
+  {
+    lowp[i] = mempool_alloc(&lpool);
+    assert(mempool_blk_index(&lpool, lowp[i]) == i);
+  }
+
+  /* Both lists stay consistent when blocks leave from the middle */
+  assert(TRUE == mempool_rel(&lpool, lowp[4100]));
+  assert(TRUE == mempool_rel(&lpool, lowp[7]));
+  assert(TRUE == mempool_rel(&lpool, lowp[4099]));
+  for (i = 0, blkp = lpool.memusedp; blkp; blkp = blkp->nextp, i++)
+  {
+    assert(TRUE == blkp->used);
+    assert(!blkp->nextp || blkp->nextp->prevp == blkp);
+  }
+  assert(i == num_low - 3);
+  for (i = 0, blkp = lpool.memfreedp; blkp; blkp = blkp->nextp, i++)
+  {
+    assert(FALSE == blkp->used);
+    assert(!blkp->nextp || blkp->nextp->prevp == blkp);
+  }
+  assert(i == 3);
+  assert(lowp[7] == mempool_alloc(&lpool));
+
+  /* LIFO returns the last released block, switching back rebuilds the map */
+  assert(TRUE == mempool_set_policy(&lpool, MEMPOOL_POLICY_LIFO));
+  assert(lowp[4099] == mempool_alloc(&lpool));
+  assert(TRUE == mempool_rel(&lpool, lowp[4099]));
+  assert(TRUE == mempool_set_policy(&lpool, MEMPOOL_POLICY_LOWADDR));
+  assert(lowp[4099] == mempool_alloc(&lpool));
+  assert(lowp[4100] == mempool_alloc(&lpool));
+  assert(NULL == mempool_alloc(&lpool));
+  mempool_destroy(&lpool);
+  printf("... PASSED\n");
 
   mempool_destroy(&tpool);
   assert((void *) tpool.memfreedp == NULL);
@@ -1,14 +1,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
 
 #include "message.h"
 #include "mempool/mempool.h"
+#include "trace.h"
+#include "journal.h"
 
 
-#define MAX_NUM_MSG 20
 #define MAX_CLIENT_255 255
 
 #define SUCCESS 0
@@ -23,9 +29,30 @@
 * MEMBERS :     valid - To set when control block is initialized and registered
 *               tid - Thead IDs
 *               sem - Semaphore for signaling
-*               datap - Pointer to user data
+*               datap - Pointer to the message handed to the receiver
+*               lock - Protects the mailbox
+*               notfull - Signaled when a mailbox slot is freed
+*               ringp - Mailbox rings of message pointers, one per lane
+*               head[] - Index of the oldest message in each lane
+*               lanecnt[] - Number of messages queued in each lane
+*               lanemask - Bit n is set when lane n is not empty
+*               count - Number of queued messages in all lanes
+*               limit - Mailbox capacity
+*               reserved - Slots reserved by senders holding credits
+*               policy - What to do when the mailbox is full
+*               hwm - Queue high-water mark
+*               drops - Number of messages dropped
+*               sends - Number of messages queued
+*               recvs - Number of messages received
+*               notifyfn - Called after a message is queued, may be NULL
+*               notifyarg - Argument of notifyfn
+*               notifyepoch - Bumped each time notifyfn is replaced
+*               notifying[] - Running notifications, by epoch parity
+*               notifysetting - A client_set_notify is waiting for them
+*               notifydone - Signaled when a notification returns
+*               poolp - Private pool of client_new_message, NULL for none
 *
-* NOTES :      None
+* NOTES :      limit and policy may be set before the client registers.
 */
 struct client_ctrl_s
 {
@@ -33,6 +60,27 @@ struct client_ctrl_s
   pthread_t tid;
   sem_t sema;
   void *datap;
+  pthread_mutex_t lock;
+  pthread_cond_t notfull;
+  message_t **ringp;
+  uint32_t head[MSG_NUM_PRIO];
+  uint32_t lanecnt[MSG_NUM_PRIO];
+  uint32_t lanemask;
+  uint32_t count;
+  uint32_t limit;
+  uint32_t reserved;
+  msg_policy_t policy;
+  uint32_t hwm;
+  uint32_t drops;
+  uint64_t sends;
+  uint64_t recvs;
+  msg_notify_fn notifyfn;
+  void *notifyarg;
+  uint32_t notifyepoch;
+  uint32_t notifying[2];
+  boolean notifysetting;
+  pthread_cond_t notifydone;
+  mempool_t *poolp;
 };
 
 /* Since uint8_t data type for client_id is used, max number of client is 255
@@ -40,11 +88,87 @@ struct client_ctrl_s
 * This can be improved bu using hash table for cases where number of clients are
 * significantly large.
 */
-static struct client_ctrl_s cidtable[255] = {0};
+static struct client_ctrl_s cidtable[MAX_CLIENT_255 + 1] = {0};
+
+/* Serializes client registration and mailbox configuration */
+static pthread_mutex_t cidtable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+* NAME :        call_s
+*
+* DESCRIPTION : In-flight call record
+*
+* MEMBERS :     corrid - Correlation ID of the call, 0 when no reply is expected
+*               sema - Semaphore the caller waits on
+*               replyp - Reply handed over by the server
+*
+* NOTES :      Records come from _call_pool and are protected by call_lock.
+*/
+struct call_s
+{
+  uint32_t corrid;
+  sem_t sema;
+  message_t *replyp;
+};
+
+/*
+* NAME :        msghead_s
+*
+* DESCRIPTION : Service header stored in front of every message
+*
+* MEMBERS :     corrid - Correlation ID when the message is a call request
+*               callp - Call record of the caller
+*               nextp - Next block of a chained message
+*
+* NOTES :      The header is hidden from users; new_message returns the address
+*              right after it.
+*/
+struct msghead_s
+{
+  uint32_t corrid;
+  struct call_s *callp;
+  message_t *nextp;
+};
+
+#define MSG_HEAD(msg) ((struct msghead_s *) ((uint8_t *) (msg) - sizeof(struct msghead_s)))
+/* Index of a message block in its own pool, for tracing */
+#define MSG_BLOCK(msg) mempool_blk_index(message_pool_of(msg), MSG_HEAD(msg))
 
 /* Memory pool control block */
 static mempool_t _message_pool = {0};
 
+/* The shared pool is created by message_service_init, or with the defaults
+* by the first new_message. init_lock serializes the creation; _message_ready
+* is set once the pool exists.
+*/
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static boolean _message_ready = FALSE;
+
+/* Payload bytes of each block */
+static uint32_t _message_data_max = MSG_DATA_MAX;
+
+/* Private client pools, searched when a block is not in _message_pool */
+static mempool_t *_client_pools[MAX_CLIENT_255 + 1];
+static uint32_t _num_client_pools = 0;
+
+/* Pool of in-flight call records */
+static mempool_t _call_pool = {0};
+
+/* Protects call records and correlation IDs */
+static pthread_mutex_t call_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t next_corrid = 0;
+
+/* Periodic statistics dump */
+static pthread_t stat_tid;
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stat_cond = PTHREAD_COND_INITIALIZER;
+static boolean stat_running = FALSE;
+static FILE *stat_fp = NULL;
+static uint32_t stat_period_ms = 0;
+
+/* Journal recording every queued message, NULL when disabled */
+static journal_t *_journalp = NULL;
+
 /*
 * NAME :        client_find
 *
@@ -110,23 +234,182 @@ static int signal_reg(
   uint8_t client_id,
   pthread_t thread_id)
 {
-  if (!cidtable[client_id].valid || thread_id != cidtable[client_id].tid)
+  struct client_ctrl_s *client = &cidtable[client_id];
+  int res = ERROR;
+
+  pthread_mutex_lock(&cidtable_lock);
+  do
   {
-    /* add the thread to the table of clients */
-    if (sem_init (&cidtable[client_id].sema, 0, 0) == SUCCESS)
+    if (client->valid && thread_id == client->tid)
     {
-      cidtable[client_id].tid = thread_id;
-      cidtable[client_id].valid = TRUE;
-      return SUCCESS;
+      break;
     }
-    else
+
+    if (client->valid)
+    {
+      /* Already registered by another thread; keep the queued messages */
+      client->tid = thread_id;
+      res = SUCCESS;
+      break;
+    }
+
+    if (0 == client->limit)
+    {
+      client->limit = MSG_QUEUE_DEFAULT_LIMIT;
+    }
+
+    client->ringp = (message_t **) calloc(client->limit * MSG_NUM_PRIO,
+                                          sizeof(message_t *));
+    if (!client->ringp)
+    {
+      printf("%s - Error: Cannot allocate mailbox\n", __func__);
+      break;
+    }
+
+    /* add the thread to the table of clients */
+    if (sem_init (&client->sema, 0, 0) != SUCCESS ||
+        pthread_mutex_init(&client->lock, NULL) != SUCCESS ||
+        pthread_cond_init(&client->notfull, NULL) != SUCCESS ||
+        pthread_cond_init(&client->notifydone, NULL) != SUCCESS)
     {
       printf("%s - Error: Cannot initialize semaphore\n", __func__);
-      return ERROR;
+      free(client->ringp);
+      client->ringp = NULL;
+      break;
     }
+
+    memset(client->head, 0, sizeof(client->head));
+    memset(client->lanecnt, 0, sizeof(client->lanecnt));
+    client->lanemask = 0;
+    client->count = 0;
+    client->reserved = 0;
+    client->hwm = 0;
+    client->drops = 0;
+    client->sends = 0;
+    client->recvs = 0;
+    client->tid = thread_id;
+    client->valid = TRUE;
+    res = SUCCESS;
+  } while(0);
+  pthread_mutex_unlock(&cidtable_lock);
+
+  return res;
+}
+
+/*
+* NAME :        mailbox_push
+*
+* DESCRIPTION : Appends a message to the tail of a lane of a client's mailbox
+*
+* INPUTS :      client - client control block
+*               msg - message to queue
+*               prio - lane, 0 is the highest priority
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API. Caller holds client->lock and has checked
+*               that a slot is available.
+*/
+static void mailbox_push(
+  struct client_ctrl_s *client,
+  message_t *msg,
+  uint8_t prio)
+{
+  message_t **lanep = client->ringp + prio * client->limit;
+
+  lanep[(client->head[prio] + client->lanecnt[prio]) % client->limit] = msg;
+  client->lanecnt[prio]++;
+  client->lanemask |= 1u << prio;
+  client->count++;
+  client->sends++;
+
+  if (client->count > client->hwm)
+  {
+    client->hwm = client->count;
   }
+}
 
-  return ERROR;
+/*
+* NAME :        mailbox_pop_lane
+*
+* DESCRIPTION : Removes the oldest message of a lane of a client's mailbox
+*
+* INPUTS :      client - client control block
+*               prio - lane, must not be empty
+*
+* OUTPUTS :     Oldest message of the lane
+*
+* NOTES :       It is a static API. Caller holds client->lock.
+*/
+static message_t * mailbox_pop_lane(
+  struct client_ctrl_s *client,
+  uint8_t prio)
+{
+  message_t **lanep = client->ringp + prio * client->limit;
+  message_t *msg = lanep[client->head[prio]];
+
+  client->head[prio] = (client->head[prio] + 1) % client->limit;
+  client->count--;
+  if (0 == --client->lanecnt[prio])
+  {
+    client->lanemask &= ~(1u << prio);
+  }
+
+  return msg;
+}
+
+/*
+* NAME :        mailbox_pop
+*
+* DESCRIPTION : Removes the oldest message of the highest priority non-empty
+*               lane of a client's mailbox
+*
+* INPUTS :      client - client control block
+*
+* OUTPUTS :     Oldest message or NULL if the mailbox is empty
+*
+* NOTES :       It is a static API. Caller holds client->lock.
+*/
+static message_t * mailbox_pop(
+  struct client_ctrl_s *client)
+{
+  if (!client->lanemask)
+  {
+    return NULL;
+  }
+
+  return mailbox_pop_lane(client, __builtin_ffs(client->lanemask) - 1);
+}
+
+/*
+* NAME :        notify_take
+*
+* DESCRIPTION : Reads the notify hook of a client and counts the
+*               notification as running
+*
+* INPUTS :      client - client control block
+*               notifyfnp - set to client->notifyfn, may be NULL
+*               notifyargp - set to client->notifyarg
+*
+* OUTPUTS :     Slot to pass to signal_send
+*
+* NOTES :       It is a static API, called with client->lock held.
+*/
+static uint32_t notify_take(
+  struct client_ctrl_s *client,
+  msg_notify_fn *notifyfnp,
+  void **notifyargp)
+{
+  uint32_t slot = client->notifyepoch & 1;
+
+  *notifyfnp = client->notifyfn;
+  *notifyargp = client->notifyarg;
+  if (*notifyfnp)
+  {
+    client->notifying[slot]++;
+  }
+
+  return slot;
 }
 
 /*
@@ -135,21 +418,48 @@ static int signal_reg(
 * DESCRIPTION : To send a signal to a client
 *
 * INPUTS :      client - client control block
+*               notifyfn - hook read by notify_take, may be NULL
+*               notifyarg - argument read by notify_take
+*               notifyslot - slot returned by notify_take
 *
 * OUTPUTS :     SUCCESS - Success
 *               ERROR - Failed
 *
-* NOTES :       It is a static API
+* NOTES :       It is a static API. The caller reads notifyfn and notifyarg
+*               together while it holds client->lock, so a concurrent
+*               client_set_notify never pairs a function with another
+*               function's argument, and waits for this call to return.
 */
 static int signal_send(
-  struct client_ctrl_s *client)
+  struct client_ctrl_s *client,
+  msg_notify_fn notifyfn,
+  void *notifyarg,
+  uint32_t notifyslot)
 {
+  int res = ERROR;
+
   if (client)
   {
-    return sem_post(&client->sema);
+    res = sem_post(&client->sema);
+
+    /* Let an event-driven receiver know the mailbox has work */
+    if (notifyfn)
+    {
+      if (SUCCESS == res)
+      {
+        notifyfn((uint8_t) (client - cidtable), notifyarg);
+      }
+
+      pthread_mutex_lock(&client->lock);
+      if (0 == --client->notifying[notifyslot])
+      {
+        pthread_cond_broadcast(&client->notifydone);
+      }
+      pthread_mutex_unlock(&client->lock);
+    }
   }
 
-  return ERROR;
+  return res;
 }
 
 /*
@@ -185,6 +495,122 @@ static int signal_wait(
   return SUCCESS;
 }
 
+/*
+* NAME :        message_pool_of
+*
+* DESCRIPTION : Finds the pool a message block belongs to
+*
+* INPUTS :      msg - message block
+*
+* OUTPUTS :     Pool, NULL if the block is not a message
+*
+* NOTES :       It is a static API. The shared pool is checked first; private
+*               client pools are only searched when they exist.
+*/
+static mempool_t * message_pool_of(
+  message_t *msg)
+{
+  uint32_t num = __atomic_load_n(&_num_client_pools, __ATOMIC_ACQUIRE);
+
+  if (!msg)
+  {
+    return NULL;
+  }
+
+  if (mempool_is_mem_valid(&_message_pool, MSG_HEAD(msg)))
+  {
+    return &_message_pool;
+  }
+
+  for (uint32_t i = 0; i < num; i++)
+  {
+    if (mempool_is_mem_valid(_client_pools[i], MSG_HEAD(msg)))
+    {
+      return _client_pools[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+* NAME :        message_pool_create
+*
+* DESCRIPTION : Creates the shared message pool
+*
+* INPUTS :      configp - Service configuration, NULL for the defaults
+*
+* OUTPUTS :     TRUE - Created
+*               FALSE - Failed
+*
+* NOTES :       It is a static API, called with init_lock held. Blocks always
+*               hold a whole message_t, whatever the configured msg_size.
+*/
+static boolean message_pool_create(
+  const msg_config_t *configp)
+{
+  uint32_t pool_size = MSG_POOL_DEFAULT_SIZE;
+
+  if (configp && configp->pool_size)
+  {
+    pool_size = configp->pool_size;
+  }
+
+  if (!mempool_init(&_message_pool, pool_size,
+                    sizeof(struct msghead_s) + sizeof(message_t)))
+  {
+    printf("%s - Error: Cannot initialize memory pool.\n", __func__);
+    return FALSE;
+  }
+
+  _message_data_max = configp && configp->msg_size ? configp->msg_size : MSG_DATA_MAX;
+  __atomic_store_n(&_message_ready, TRUE, __ATOMIC_RELEASE);
+
+  return TRUE;
+}
+
+/*
+* NAME :        message_alloc
+*
+* DESCRIPTION : Takes a message block from a pool
+*
+* INPUTS :      poolp - pool
+*
+* OUTPUTS :     New message, NULL if the pool is empty
+*
+* NOTES :       It is a static API
+*/
+static message_t * message_alloc(
+  mempool_t *poolp)
+{
+  struct msghead_s *headp = NULL;
+
+  if (!__atomic_load_n(&_message_ready, __ATOMIC_ACQUIRE))
+  {
+    pthread_mutex_lock(&init_lock);
+    if (!_message_ready && !message_pool_create(NULL))
+    {
+      pthread_mutex_unlock(&init_lock);
+      printf("%s - Error: Message pool is not initialized.\n", __func__);
+      return NULL;
+    }
+    pthread_mutex_unlock(&init_lock);
+  }
+
+  headp = (struct msghead_s *) mempool_alloc(poolp);
+  if (!headp)
+  {
+    return NULL;
+  }
+
+  headp->corrid = 0;
+  headp->callp = NULL;
+  headp->nextp = NULL;
+  TRACE_EVENT(TRACE_ALLOC, TRACE_NO_CLIENT, mempool_blk_index(poolp, headp));
+
+  return (message_t *) (headp + 1);
+}
+
 /*
 * NAME :        new_message
 *
@@ -194,117 +620,1750 @@ static int signal_wait(
 *
 * OUTPUTS :     Returns a new message type message_t
 *
-* NOTES :       It uses mempool library to allocate memory
+* NOTES :       It uses mempool library to allocate memory. The first call
+*               creates the pool with the defaults unless
+*               message_service_init was called before.
 */
 message_t * new_message(
   void)
 {
-  if (!_message_pool.poolinited &&
-      !mempool_init(&_message_pool, MAX_NUM_MSG, sizeof(message_t)))
-  {
-    printf("%s - Error: Cannot initialize memory pool.\n", __func__);
-    return NULL;
-  }
+  return message_alloc(&_message_pool);
+}
+
+/*
+* NAME :        client_new_message
+*
+* DESCRIPTION : Get a new message from a client's private pool
+*
+* INPUTS :      client_id - ID of client with a private pool
+*
+* OUTPUTS :     Returns a new message type message_t
+*
+* NOTES :       Clients without a private pool get a message from the shared
+*               pool. delete_message returns the block to its own pool.
+*/
+message_t * client_new_message(
+  uint8_t client_id)
+{
+  mempool_t *poolp = cidtable[client_id].poolp;
 
-  return (message_t *) mempool_alloc(&_message_pool);
+  return message_alloc(poolp ? poolp : &_message_pool);
 }
 
 /*
-* NAME :        delete_message
+* NAME :        message_data_max
 *
-* DESCRIPTION : Deletes a message
+* DESCRIPTION : Returns the payload capacity of a message block
 *
-* INPUTS :      msg - message to delete
+* INPUTS :      None
 *
-* OUTPUTS :     None
+* OUTPUTS :     Bytes of data[] usable in each block
 *
-* NOTES :       None
+* NOTES :       MSG_DATA_MAX unless message_service_init set a smaller size.
+*               chain_append fills blocks up to this size; a block still
+*               has room for a whole message_t.
 */
-void delete_message(message_t *msg)
+uint32_t message_data_max(
+  void)
 {
-  mempool_rel(&_message_pool, (void *) msg);
+  return _message_data_max;
 }
 
 /*
-* NAME :        send
+* NAME :        message_pretouch
 *
-* DESCRIPTION : Sends a message to client by ID
+* DESCRIPTION : Writes one byte of every page of a memory range
 *
-* INPUTS :      destination_id - ID of destination client
-*               msg - message to send
+* INPUTS :      memp - start of range
+*               len - length of range
 *
-* OUTPUTS :     ERROR - failure
-*               SUCCESS - Successful
+* OUTPUTS :     None
 *
-* NOTES :       None
+* NOTES :       It is a static API. The bytes keep their value; the writes
+*               only fault the pages in. It is used for the calloc'd
+*               mailbox rings, which may be fresh zero pages that fault on
+*               first use; mempool_init already writes all pool memory.
 */
-int send(
-  uint8_t destination_id,
-  message_t* msg)
+static void message_pretouch(
+  void *memp,
+  size_t len)
 {
-  struct client_ctrl_s *client = NULL;
+  volatile uint8_t *bytep = (volatile uint8_t *) memp;
+  size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
 
-  if (!msg)
+  for (size_t off = 0; off < len; off += pagesize)
   {
-    printf("%s - Error: invalid message.\n", __func__);
-    return ERROR;
+    bytep[off] = bytep[off];
   }
+}
 
-  client = client_find(destination_id);
-  if (!client)
+/*
+* NAME :        message_config_check
+*
+* DESCRIPTION : Validates a service configuration
+*
+* INPUTS :      configp - Service configuration
+*
+* OUTPUTS :     TRUE - Valid
+*               FALSE - Invalid
+*
+* NOTES :       It is a static API
+*/
+static boolean message_config_check(
+  const msg_config_t *configp)
+{
+  boolean seen[MAX_CLIENT_255 + 1] = {FALSE};
+  const msg_client_config_t *clientp = NULL;
+
+  if (configp->msg_size > MSG_DATA_MAX || (configp->numclients && !configp->clientsp))
   {
-    printf("%s - Error: invalid client.\n", __func__);
-    return ERROR;
+    return FALSE;
   }
 
-  /* Store message address in client control block */
-  client->datap = (void *) msg;
+  for (uint32_t i = 0; i < configp->numclients; i++)
+  {
+    clientp = &configp->clientsp[i];
+    if (seen[clientp->client_id] || clientp->policy > MSG_POLICY_DROP_OLDEST)
+    {
+      return FALSE;
+    }
+    seen[clientp->client_id] = TRUE;
+  }
 
-  /* Send a signal to client */
-  return signal_send(client);
+  return TRUE;
 }
 
 /*
-* NAME :        recv
+* NAME :        message_service_init
 *
-* DESCRIPTION : Waits to receive a message
+* DESCRIPTION : Creates the message pools and registers clients up front
 *
-* INPUTS :      msg - message to receive
+* INPUTS :      configp - Service configuration, NULL for the defaults
 *
-* OUTPUTS :     ERROR - failure
+* OUTPUTS :     ERROR - failure, or the service was already initialized
 *               SUCCESS - Successful
 *
-* NOTES :       This is a blocking API.
+* NOTES :       Call it before the first message is allocated. Configured
+*               clients are registered with their limit and policy, so they
+*               can be sent to before their receiver starts. The whole
+*               configuration is checked first. If creating a pool fails,
+*               the pools created so far are freed and it may be called
+*               again; clients registered meanwhile stay registered. With
+*               pretouch, mailboxes are faulted in before traffic starts.
 */
-int recv(
-  uint8_t receiver_id,
-  message_t* msg)
+int message_service_init(
+  const msg_config_t *configp)
 {
+  static const msg_config_t defconfig = {0};
+  const msg_client_config_t *clientp = NULL;
   struct client_ctrl_s *client = NULL;
-  pthread_t tid = 0;
-  client = client_find(receiver_id);
+  mempool_t *poolp = NULL;
+  int res = SUCCESS;
 
-  if (!client)
+  if (!configp)
   {
-    tid = pthread_self();
-    if (SUCCESS != signal_reg(receiver_id, tid))
-    {
-      printf("%s - Error: Cannot register.\n", __func__);
-      return ERROR;
-    }
-
-    client = client_find(receiver_id);
+    configp = &defconfig;
   }
 
-  if (client && signal_wait(client) == SUCCESS)
+  if (!message_config_check(configp))
   {
-    *((void **)msg) = &client->datap;
-    return SUCCESS;
+    printf("%s - Error: Incorrect input parameters.\n", __func__);
+    return ERROR;
   }
-  else
+
+  pthread_mutex_lock(&init_lock);
+  if (_message_ready)
   {
-    printf("%s - Error: Cannot receive message.\n", __func__);
+    pthread_mutex_unlock(&init_lock);
+    printf("%s - Error: Already initialized.\n", __func__);
+    return ERROR;
+  }
+
+  if (!message_pool_create(configp))
+  {
+    pthread_mutex_unlock(&init_lock);
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&call_lock);
+  if (!_call_pool.poolinited)
+  {
+    mempool_init(&_call_pool, MSG_MAX_CALLS, sizeof(struct call_s));
+  }
+  pthread_mutex_unlock(&call_lock);
+
+  for (uint32_t i = 0; i < configp->numclients; i++)
+  {
+    clientp = &configp->clientsp[i];
+    client = &cidtable[clientp->client_id];
+
+    if (clientp->limit &&
+        SUCCESS != client_set_limit(clientp->client_id, clientp->limit, clientp->policy))
+    {
+      res = ERROR;
+      break;
+    }
+
+    /* A client may be registered already, e.g. by an earlier attempt */
+    if (!client->valid && SUCCESS != signal_reg(clientp->client_id, 0))
+    {
+      printf("%s - Error: Cannot register client %u.\n", __func__, clientp->client_id);
+      res = ERROR;
+      break;
+    }
+
+    if (clientp->pool_size)
+    {
+      /* mempool_t must be 64-byte aligned, which calloc does not promise */
+      poolp = NULL;
+      if (SUCCESS != posix_memalign((void **) &poolp, MEMPOOL_CACHELINE, sizeof(mempool_t)))
+      {
+        poolp = NULL;
+      }
+      else
+      {
+        memset(poolp, 0, sizeof(mempool_t));
+      }
+
+      if (!poolp || !mempool_init(poolp, clientp->pool_size,
+                                  sizeof(struct msghead_s) + sizeof(message_t)))
+      {
+        free(poolp);
+        printf("%s - Error: Cannot create pool of client %u.\n", __func__, clientp->client_id);
+        res = ERROR;
+        break;
+      }
+
+      /* Visible to message_pool_of before any block is handed out */
+      _client_pools[_num_client_pools] = poolp;
+      __atomic_store_n(&_num_client_pools, _num_client_pools + 1, __ATOMIC_RELEASE);
+      client->poolp = poolp;
+    }
+
+    if (configp->pretouch)
+    {
+      message_pretouch(client->ringp, client->limit * MSG_NUM_PRIO * sizeof(message_t *));
+    }
+  }
+
+  if (SUCCESS != res)
+  {
+    /* Nothing was allocated from the pools yet; free them all */
+    for (uint32_t i = 0; i < configp->numclients; i++)
+    {
+      cidtable[configp->clientsp[i].client_id].poolp = NULL;
+    }
+    for (uint32_t i = 0; i < _num_client_pools; i++)
+    {
+      mempool_destroy(_client_pools[i]);
+      free(_client_pools[i]);
+      _client_pools[i] = NULL;
+    }
+    __atomic_store_n(&_num_client_pools, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&_message_ready, FALSE, __ATOMIC_RELEASE);
+    mempool_destroy(&_message_pool);
+    _message_data_max = MSG_DATA_MAX;
+  }
+  pthread_mutex_unlock(&init_lock);
+
+  return res;
+}
+
+/*
+* NAME :        call_fail
+*
+* DESCRIPTION : Wakes the caller waiting for a request that is going away
+*               without a reply
+*
+* INPUTS :      headp - header of the request
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API. The caller's call returns MSG_ERROR.
+*/
+static void call_fail(
+  struct msghead_s *headp)
+{
+  struct call_s *callp = NULL;
+
+  pthread_mutex_lock(&call_lock);
+  callp = headp->callp;
+  if (callp && headp->corrid && callp->corrid == headp->corrid)
+  {
+    callp->corrid = 0;
+    sem_post(&callp->sema);
+  }
+  headp->callp = NULL;
+  headp->corrid = 0;
+  pthread_mutex_unlock(&call_lock);
+}
+
+/*
+* NAME :        delete_message
+*
+* DESCRIPTION : Deletes a message
+*
+* INPUTS :      msg - message to delete
+*
+* OUTPUTS :     None
+*
+* NOTES :       All blocks of a chained message are deleted. Deleting a call
+*               request that was not answered fails the call.
+*/
+void delete_message(message_t *msg)
+{
+  message_t *nextp = NULL;
+  mempool_t *poolp = NULL;
+
+  while (msg)
+  {
+    poolp = message_pool_of(msg);
+    if (!poolp)
+    {
+      printf("%s - Error: Message is not in pool.\n", __func__);
+      break;
+    }
+
+    if (MSG_HEAD(msg)->callp)
+    {
+      call_fail(MSG_HEAD(msg));
+    }
+
+    nextp = MSG_HEAD(msg)->nextp;
+    TRACE_EVENT(TRACE_FREE, TRACE_NO_CLIENT, mempool_blk_index(poolp, MSG_HEAD(msg)));
+    mempool_rel(poolp, (void *) MSG_HEAD(msg));
+    msg = nextp;
+  }
+}
+
+/*
+* NAME :        send
+*
+* DESCRIPTION : Sends a message to client by ID
+*
+* INPUTS :      destination_id - ID of destination client
+*               msg - message to send
+*
+* OUTPUTS :     ERROR - failure
+*               MSG_FULL - Mailbox is full and policy is MSG_POLICY_FAIL,
+*                          or the journal has no segment ready and the
+*                          policy is not MSG_POLICY_BLOCK
+*               SUCCESS - Successful
+*
+* NOTES :       The message is queued in the MSG_PRIO_DEFAULT lane.
+*/
+int send(
+  uint8_t destination_id,
+  message_t* msg)
+{
+  return send_prio(destination_id, msg, MSG_PRIO_DEFAULT);
+}
+
+/*
+* NAME :        send_lsn
+*
+* DESCRIPTION : Queues a message and records it in the journal if one is set
+*
+* INPUTS :      destination_id - ID of destination client
+*               msg - message to send
+*               prio - Mailbox lane
+*               lsnp - set to the journal sequence number, may be NULL
+*
+* OUTPUTS :     ERROR - failure
+*               MSG_FULL - Mailbox is full and policy is MSG_POLICY_FAIL,
+*                          or the journal has no segment ready and the
+*                          policy is not MSG_POLICY_BLOCK
+*               SUCCESS - Successful
+*
+* NOTES :       It is a static API
+*/
+static int send_lsn(
+  uint8_t destination_id,
+  message_t* msg,
+  uint8_t prio,
+  uint64_t *lsnp)
+{
+  struct client_ctrl_s *client = NULL;
+  journal_t *jp = _journalp;
+  message_t *droppedp = NULL;
+  msg_notify_fn notifyfn = NULL;
+  void *notifyarg = NULL;
+  uint32_t notifyslot = 0;
+  boolean dropoldest = FALSE;
+  uint8_t droplane = 0;
+  int res = SUCCESS;
+
+  if (!msg || prio >= MSG_NUM_PRIO)
+  {
+    printf("%s - Error: invalid message.\n", __func__);
+    return ERROR;
+  }
+
+  client = client_find(destination_id);
+  if (!client)
+  {
+    printf("%s - Error: invalid client.\n", __func__);
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  while (1)
+  {
+    while (client->count + client->reserved >= client->limit)
+    {
+      if (MSG_POLICY_BLOCK == client->policy)
+      {
+        pthread_cond_wait(&client->notfull, &client->lock);
+      }
+      else if (MSG_POLICY_DROP_OLDEST == client->policy && client->count)
+      {
+        /* Never drop a message of higher priority than the new one; when
+        * every queued message has one, the new message is dropped.
+        */
+        droplane = 31 - __builtin_clz(client->lanemask);
+        if (droplane < prio)
+        {
+          client->drops++;
+          pthread_mutex_unlock(&client->lock);
+          delete_message(msg);
+          return SUCCESS;
+        }
+        dropoldest = TRUE;
+        break;
+      }
+      else
+      {
+        pthread_mutex_unlock(&client->lock);
+        return MSG_FULL;
+      }
+    }
+
+    /* Record the message once it is sure to be queued, in queueing order */
+    res = jp ? journal_append(jp, destination_id, prio, msg, lsnp) : SUCCESS;
+    if (MSG_FULL != res || MSG_POLICY_BLOCK != client->policy)
+    {
+      break;
+    }
+
+    /* A blocking sender waits for the next segment as for a mailbox slot,
+    * then checks the mailbox again.
+    */
+    pthread_mutex_unlock(&client->lock);
+    if (journal_wait_spare(jp) != SUCCESS)
+    {
+      printf("%s - Error: Journal stopped.\n", __func__);
+      return ERROR;
+    }
+    pthread_mutex_lock(&client->lock);
+  }
+
+  if (SUCCESS != res)
+  {
+    pthread_mutex_unlock(&client->lock);
+    return res;
+  }
+
+  if (dropoldest)
+  {
+    /* Make room by dropping the oldest message. The receiver was already
+    * signaled for it, so the new message reuses that signal.
+    */
+    droppedp = mailbox_pop_lane(client, droplane);
+    client->drops++;
+  }
+
+  /* Store message address in client's mailbox */
+  mailbox_push(client, msg, prio);
+  if (!droppedp)
+  {
+    notifyslot = notify_take(client, &notifyfn, &notifyarg);
+  }
+  pthread_mutex_unlock(&client->lock);
+  TRACE_EVENT(TRACE_SEND, destination_id, MSG_BLOCK(msg));
+
+  if (droppedp)
+  {
+    delete_message(droppedp);
+    return SUCCESS;
+  }
+
+  /* Send a signal to client */
+  return signal_send(client, notifyfn, notifyarg, notifyslot);
+}
+
+/*
+* NAME :        send_prio
+*
+* DESCRIPTION : Sends a message to client by ID with a priority
+*
+* INPUTS :      destination_id - ID of destination client
+*               msg - message to send
+*               prio - Mailbox lane, MSG_PRIO_HIGHEST is received first
+*
+* OUTPUTS :     ERROR - failure
+*               MSG_FULL - Mailbox is full and policy is MSG_POLICY_FAIL,
+*                          or the journal has no segment ready and the
+*                          policy is not MSG_POLICY_BLOCK
+*               SUCCESS - Successful
+*
+* NOTES :       The message is queued in the destination's mailbox. When the
+*               mailbox is full, the destination's policy decides whether the
+*               sender waits, fails or replaces the oldest message of the
+*               lowest priority non-empty lane. If that lane has a higher
+*               priority than prio, the new message is dropped instead.
+*               With a journal set, a sender to a MSG_POLICY_BLOCK client
+*               also waits for the next segment when none is ready.
+*/
+int send_prio(
+  uint8_t destination_id,
+  message_t* msg,
+  uint8_t prio)
+{
+  return send_lsn(destination_id, msg, prio, NULL);
+}
+
+/*
+* NAME :        send_durable
+*
+* DESCRIPTION : Sends a message and waits until it is in the journal on disk
+*
+* INPUTS :      destination_id - ID of destination client
+*               msg - message to send
+*               prio - Mailbox lane, MSG_PRIO_HIGHEST is received first
+*
+* OUTPUTS :     ERROR - failure or no journal attached
+*               MSG_FULL - Mailbox is full and policy is MSG_POLICY_FAIL,
+*                          or the journal has no segment ready and the
+*                          policy is not MSG_POLICY_BLOCK
+*               SUCCESS - Successful
+*
+* NOTES :       The receiver may get the message before it is on disk; only
+*               the return of this call is delayed. Senders waiting at the
+*               same time share one flush.
+*/
+int send_durable(
+  uint8_t destination_id,
+  message_t* msg,
+  uint8_t prio)
+{
+  journal_t *jp = _journalp;
+  uint64_t lsn = 0;
+  int res = SUCCESS;
+
+  if (!jp)
+  {
+    printf("%s - Error: No journal.\n", __func__);
+    return ERROR;
+  }
+
+  res = send_lsn(destination_id, msg, prio, &lsn);
+  if (SUCCESS != res)
+  {
+    return res;
+  }
+
+  return journal_wait(jp, lsn);
+}
+
+/*
+* NAME :        message_set_journal
+*
+* DESCRIPTION : Records every message queued from now on in a journal
+*
+* INPUTS :      jp - open journal, NULL to stop recording
+*
+* OUTPUTS :     None
+*
+* NOTES :       Set it while no message is being sent. To recover after a
+*               restart, call journal_replay before attaching the journal.
+*/
+void message_set_journal(
+  struct journal_s *jp)
+{
+  _journalp = jp;
+}
+
+/*
+* NAME :        recv
+*
+* DESCRIPTION : Waits to receive a message
+*
+* INPUTS :      msg - message to receive
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       This is a blocking API.
+*/
+int recv(
+  uint8_t receiver_id,
+  message_t* msg)
+{
+  struct client_ctrl_s *client = NULL;
+  pthread_t tid = 0;
+  client = client_find(receiver_id);
+
+  if (!client)
+  {
+    tid = pthread_self();
+    if (SUCCESS != signal_reg(receiver_id, tid))
+    {
+      printf("%s - Error: Cannot register.\n", __func__);
+      return ERROR;
+    }
+
+    client = client_find(receiver_id);
+  }
+
+  if (client && signal_wait(client) == SUCCESS)
+  {
+    TRACE_EVENT(TRACE_WAKE, receiver_id, -1);
+
+    /* Take the oldest message and free its slot for blocked senders */
+    pthread_mutex_lock(&client->lock);
+    client->datap = (void *) mailbox_pop(client);
+    client->recvs++;
+    pthread_cond_signal(&client->notfull);
+    pthread_mutex_unlock(&client->lock);
+    TRACE_EVENT(TRACE_RECV, receiver_id, client->datap ? MSG_BLOCK(client->datap) : -1);
+
+    *((void **)msg) = &client->datap;
+    return SUCCESS;
+  }
+  else
+  {
+    printf("%s - Error: Cannot receive message.\n", __func__);
   }
 
   return ERROR;
 }
+
+/*
+* NAME :        client_set_limit
+*
+* DESCRIPTION : Sets the mailbox capacity and the full-mailbox policy of a client
+*
+* INPUTS :      client_id - ID of client
+*               limit - Maximum number of queued messages
+*               policy - What send does when the mailbox is full
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       It can be called before the client registers. A registered
+*               mailbox cannot shrink below its queued and reserved messages.
+*/
+int client_set_limit(
+  uint8_t client_id,
+  uint32_t limit,
+  msg_policy_t policy)
+{
+  struct client_ctrl_s *client = &cidtable[client_id];
+  message_t **ringp = NULL;
+  int res = ERROR;
+
+  if (0 == limit)
+  {
+    printf("%s - Error: Invalid limit.\n", __func__);
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&cidtable_lock);
+  if (!client->valid)
+  {
+    client->limit = limit;
+    client->policy = policy;
+    pthread_mutex_unlock(&cidtable_lock);
+    return SUCCESS;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  do
+  {
+    if (limit < client->count + client->reserved)
+    {
+      printf("%s - Error: Mailbox holds more than %u messages.\n", __func__, limit);
+      break;
+    }
+
+    ringp = (message_t **) calloc(limit * MSG_NUM_PRIO, sizeof(message_t *));
+    if (!ringp)
+    {
+      printf("%s - Error: Cannot allocate mailbox.\n", __func__);
+      break;
+    }
+
+    /* Move queued messages to the new rings, oldest first */
+    for (uint32_t lane = 0; lane < MSG_NUM_PRIO; lane++)
+    {
+      for (uint32_t i = 0; i < client->lanecnt[lane]; i++)
+      {
+        ringp[lane * limit + i] = client->ringp[lane * client->limit +
+                                   (client->head[lane] + i) % client->limit];
+      }
+      client->head[lane] = 0;
+    }
+
+    free(client->ringp);
+    client->ringp = ringp;
+    client->limit = limit;
+    client->policy = policy;
+    pthread_cond_broadcast(&client->notfull);
+    res = SUCCESS;
+  } while(0);
+  pthread_mutex_unlock(&client->lock);
+  pthread_mutex_unlock(&cidtable_lock);
+
+  return res;
+}
+
+/*
+* NAME :        client_get_stat
+*
+* DESCRIPTION : Reports the mailbox counters of a client
+*
+* INPUTS :      client_id - ID of client
+*               statp - Buffer to fill
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       None
+*/
+int client_get_stat(
+  uint8_t client_id,
+  client_stat_t *statp)
+{
+  struct client_ctrl_s *client = client_find(client_id);
+
+  if (!client || !statp)
+  {
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  statp->depth = client->count;
+  statp->limit = client->limit;
+  statp->hwm = client->hwm;
+  statp->drops = client->drops;
+  statp->credits = client->limit - client->count - client->reserved;
+  statp->reserved = client->reserved;
+  statp->sends = client->sends;
+  statp->recvs = client->recvs;
+  pthread_mutex_unlock(&client->lock);
+
+  return SUCCESS;
+}
+
+/*
+* NAME :        send_credits
+*
+* DESCRIPTION : Number of messages that can be sent to a client before the
+*               mailbox is full
+*
+* INPUTS :      destination_id - ID of destination client
+*
+* OUTPUTS :     ERROR - failure
+*               Number of free mailbox slots
+*
+* NOTES :       The value is a snapshot. Use credit_acquire to hold slots.
+*/
+int send_credits(
+  uint8_t destination_id)
+{
+  struct client_ctrl_s *client = client_find(destination_id);
+  int res = ERROR;
+
+  if (client)
+  {
+    pthread_mutex_lock(&client->lock);
+    res = (int) (client->limit - client->count - client->reserved);
+    pthread_mutex_unlock(&client->lock);
+  }
+
+  return res;
+}
+
+/*
+* NAME :        credit_acquire
+*
+* DESCRIPTION : Reserves mailbox slots of a client for the caller
+*
+* INPUTS :      destination_id - ID of destination client
+*               num_credits - Number of slots wanted
+*
+* OUTPUTS :     ERROR - failure
+*               Number of slots reserved, between 0 and num_credits
+*
+* NOTES :       It never blocks. Each reserved slot is used by one call to
+*               send_with_credit or returned by credit_release.
+*/
+int credit_acquire(
+  uint8_t destination_id,
+  uint32_t num_credits)
+{
+  struct client_ctrl_s *client = client_find(destination_id);
+  uint32_t avail = 0;
+
+  if (!client)
+  {
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  avail = client->limit - client->count - client->reserved;
+  if (num_credits > avail)
+  {
+    num_credits = avail;
+  }
+  client->reserved += num_credits;
+  pthread_mutex_unlock(&client->lock);
+
+  return (int) num_credits;
+}
+
+/*
+* NAME :        credit_release
+*
+* DESCRIPTION : Returns unused reserved slots to a client's mailbox
+*
+* INPUTS :      destination_id - ID of destination client
+*               num_credits - Number of slots to return
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       None
+*/
+int credit_release(
+  uint8_t destination_id,
+  uint32_t num_credits)
+{
+  struct client_ctrl_s *client = client_find(destination_id);
+  int res = ERROR;
+
+  if (!client)
+  {
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  if (num_credits <= client->reserved)
+  {
+    client->reserved -= num_credits;
+    pthread_cond_broadcast(&client->notfull);
+    res = SUCCESS;
+  }
+  pthread_mutex_unlock(&client->lock);
+
+  return res;
+}
+
+/*
+* NAME :        send_with_credit
+*
+* DESCRIPTION : Sends a message using a slot reserved by credit_acquire
+*
+* INPUTS :      destination_id - ID of destination client
+*               msg - message to send
+*
+* OUTPUTS :     ERROR - failure or no credit held
+*               MSG_FULL - The journal has no segment ready
+*               SUCCESS - Successful
+*
+* NOTES :       It never blocks and never drops a message.
+*/
+int send_with_credit(
+  uint8_t destination_id,
+  message_t* msg)
+{
+  struct client_ctrl_s *client = client_find(destination_id);
+  msg_notify_fn notifyfn = NULL;
+  void *notifyarg = NULL;
+  uint32_t notifyslot = 0;
+  int res = SUCCESS;
+
+  if (!client || !msg)
+  {
+    printf("%s - Error: Invalid input parameters.\n", __func__);
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  if (0 == client->reserved)
+  {
+    pthread_mutex_unlock(&client->lock);
+    printf("%s - Error: No credit.\n", __func__);
+    return ERROR;
+  }
+
+  res = _journalp ? journal_append(_journalp, destination_id, MSG_PRIO_DEFAULT,
+                                   msg, NULL) : SUCCESS;
+  if (SUCCESS != res)
+  {
+    pthread_mutex_unlock(&client->lock);
+    return res;
+  }
+
+  client->reserved--;
+  mailbox_push(client, msg, MSG_PRIO_DEFAULT);
+  notifyslot = notify_take(client, &notifyfn, &notifyarg);
+  pthread_mutex_unlock(&client->lock);
+  TRACE_EVENT(TRACE_SEND, destination_id, MSG_BLOCK(msg));
+
+  return signal_send(client, notifyfn, notifyarg, notifyslot);
+}
+
+/*
+* NAME :        call
+*
+* DESCRIPTION : Sends a request to a client and waits for its reply
+*
+* INPUTS :      destination_id - ID of destination client
+*               req - Request message from new_message
+*               reply - Buffer to store the reply message
+*               timeout_ms - Time to wait for the reply, negative waits forever
+*
+* OUTPUTS :     ERROR - failure, or the request was dropped or deleted
+*                       without a reply
+*               MSG_FULL - Destination mailbox is full
+*               MSG_TIMEOUT - No reply in time
+*               SUCCESS - Successful, *reply must be deleted by the caller
+*
+* NOTES :       The request is sent like any other message and the server
+*               answers with "reply". The reply is handed directly to the
+*               caller without going through a mailbox. The number of calls
+*               in flight is bounded by MSG_MAX_CALLS. The request belongs
+*               to the caller again only when the send fails.
+*/
+int call(
+  uint8_t destination_id,
+  message_t *req,
+  message_t **reply,
+  int32_t timeout_ms)
+{
+  struct msghead_s *headp = NULL;
+  struct call_s *callp = NULL;
+  struct timespec deadline;
+  int res = SUCCESS;
+
+  if (!req || !reply || !message_pool_of(req))
+  {
+    printf("%s - Error: Invalid input parameters.\n", __func__);
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&call_lock);
+  if (!_call_pool.poolinited &&
+      !mempool_init(&_call_pool, MSG_MAX_CALLS, sizeof(struct call_s)))
+  {
+    pthread_mutex_unlock(&call_lock);
+    printf("%s - Error: Cannot initialize call pool.\n", __func__);
+    return ERROR;
+  }
+  pthread_mutex_unlock(&call_lock);
+
+  callp = (struct call_s *) mempool_alloc(&_call_pool);
+  if (!callp)
+  {
+    return ERROR;
+  }
+
+  if (sem_init(&callp->sema, 0, 0) != SUCCESS)
+  {
+    mempool_rel(&_call_pool, callp);
+    return ERROR;
+  }
+
+  /* Tag the request so the server's reply can find this record */
+  pthread_mutex_lock(&call_lock);
+  if (0 == ++next_corrid)
+  {
+    ++next_corrid;
+  }
+  callp->corrid = next_corrid;
+  callp->replyp = NULL;
+  headp = MSG_HEAD(req);
+  headp->corrid = callp->corrid;
+  headp->callp = callp;
+  pthread_mutex_unlock(&call_lock);
+
+  res = send(destination_id, req);
+  if (SUCCESS == res)
+  {
+    if (timeout_ms < 0)
+    {
+      while (sem_wait(&callp->sema) != SUCCESS && EINTR == errno);
+    }
+    else
+    {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += timeout_ms / 1000;
+      deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L)
+      {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      while (sem_timedwait(&callp->sema, &deadline) != SUCCESS && EINTR == errno);
+    }
+  }
+
+  /* The server posts under call_lock, so replyp and corrid decide the
+  * outcome. A request deleted without a reply cleared corrid.
+  */
+  pthread_mutex_lock(&call_lock);
+  if (callp->replyp)
+  {
+    *reply = callp->replyp;
+    res = SUCCESS;
+  }
+  else if (SUCCESS == res)
+  {
+    res = callp->corrid ? MSG_TIMEOUT : MSG_ERROR;
+  }
+  else
+  {
+    /* Not sent, the request is the caller's again */
+    headp->callp = NULL;
+    headp->corrid = 0;
+  }
+
+  /* A late reply no longer matches this record */
+  callp->corrid = 0;
+  pthread_mutex_unlock(&call_lock);
+
+  sem_destroy(&callp->sema);
+  mempool_rel(&_call_pool, callp);
+
+  return res;
+}
+
+/*
+* NAME :        reply
+*
+* DESCRIPTION : Answers a request received from "call"
+*
+* INPUTS :      req - Request message received by the server
+*               resp - Reply message from new_message
+*
+* OUTPUTS :     ERROR - failure, the caller is gone or req is not a call
+*               SUCCESS - Successful, resp belongs to the caller
+*
+* NOTES :       Only the waiting caller is woken. req still belongs to the
+*               server and must be deleted by it.
+*/
+int reply(
+  message_t *req,
+  message_t *resp)
+{
+  struct msghead_s *headp = NULL;
+  struct call_s *callp = NULL;
+  int res = ERROR;
+
+  if (!req || !resp || !message_pool_of(req))
+  {
+    printf("%s - Error: Invalid input parameters.\n", __func__);
+    return ERROR;
+  }
+
+  headp = MSG_HEAD(req);
+
+  pthread_mutex_lock(&call_lock);
+  callp = headp->callp;
+  if (callp && headp->corrid && callp->corrid == headp->corrid)
+  {
+    callp->replyp = resp;
+    callp->corrid = 0;
+    sem_post(&callp->sema);
+    res = SUCCESS;
+  }
+  headp->callp = NULL;
+  headp->corrid = 0;
+  pthread_mutex_unlock(&call_lock);
+
+  return res;
+}
+
+/*
+* NAME :        message_corrid
+*
+* DESCRIPTION : Returns the correlation ID of a message
+*
+* INPUTS :      msg - message from new_message
+*
+* OUTPUTS :     Correlation ID or 0 if the message is not a pending call
+*
+* NOTES :       None
+*/
+uint32_t message_corrid(
+  message_t *msg)
+{
+  uint32_t corrid = 0;
+
+  if (message_pool_of(msg))
+  {
+    pthread_mutex_lock(&call_lock);
+    corrid = MSG_HEAD(msg)->corrid;
+    pthread_mutex_unlock(&call_lock);
+  }
+
+  return corrid;
+}
+
+/*
+* NAME :        try_recv
+*
+* DESCRIPTION : Takes a message from a client's mailbox without waiting
+*
+* INPUTS :      receiver_id - ID of receiving client
+*               msg - Buffer to store the message
+*
+* OUTPUTS :     ERROR - failure
+*               MSG_EMPTY - No message is queued
+*               SUCCESS - Successful, *msg must be deleted by the caller
+*
+* NOTES :       The client must already be registered.
+*/
+int try_recv(
+  uint8_t receiver_id,
+  message_t **msg)
+{
+  struct client_ctrl_s *client = client_find(receiver_id);
+
+  if (!client || !msg)
+  {
+    return ERROR;
+  }
+
+  if (sem_trywait(&client->sema) != SUCCESS)
+  {
+    return MSG_EMPTY;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  *msg = mailbox_pop(client);
+  client->recvs++;
+  pthread_cond_signal(&client->notfull);
+  pthread_mutex_unlock(&client->lock);
+  TRACE_EVENT(TRACE_RECV, receiver_id, MSG_BLOCK(*msg));
+
+  return SUCCESS;
+}
+
+/*
+* NAME :        notify_swap
+*
+* DESCRIPTION : Replaces the notify hook of a client and waits until the
+*               notifications running with the old one have returned
+*
+* INPUTS :      client - client control block
+*               notifyfn - new hook, may be NULL
+*               arg - Argument passed to notifyfn
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API, called with client->lock held. Swaps are
+*               serialized, so senders that start meanwhile count in the
+*               other slot and never delay the wait.
+*/
+static void notify_swap(
+  struct client_ctrl_s *client,
+  msg_notify_fn notifyfn,
+  void *arg)
+{
+  uint32_t slot = 0;
+
+  while (client->notifysetting)
+  {
+    pthread_cond_wait(&client->notifydone, &client->lock);
+  }
+
+  client->notifysetting = TRUE;
+  slot = client->notifyepoch & 1;
+  client->notifyarg = arg;
+  client->notifyfn = notifyfn;
+  client->notifyepoch++;
+  while (client->notifying[slot])
+  {
+    pthread_cond_wait(&client->notifydone, &client->lock);
+  }
+  client->notifysetting = FALSE;
+  pthread_cond_broadcast(&client->notifydone);
+}
+
+/*
+* NAME :        client_set_notify
+*
+* DESCRIPTION : Registers a client that is served without a blocking thread
+*
+* INPUTS :      client_id - ID of client
+*               notifyfn - Called by the sender after a message is queued,
+*                          NULL to remove
+*               arg - Argument passed to notifyfn
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       notifyfn runs on the sender's thread and must not block. The
+*               receiver takes messages with try_recv. Senders read notifyfn
+*               and arg together under the client lock. It returns once the
+*               notifications running with the previous notifyfn have
+*               returned, so their arg may be freed; for that reason it must
+*               not be called from a notifyfn of the same client.
+*/
+int client_set_notify(
+  uint8_t client_id,
+  msg_notify_fn notifyfn,
+  void *arg)
+{
+  struct client_ctrl_s *client = client_find(client_id);
+
+  if (!client)
+  {
+    if (SUCCESS != signal_reg(client_id, 0))
+    {
+      printf("%s - Error: Cannot register.\n", __func__);
+      return ERROR;
+    }
+    client = client_find(client_id);
+  }
+
+  pthread_mutex_lock(&client->lock);
+  notify_swap(client, notifyfn, arg);
+  pthread_mutex_unlock(&client->lock);
+
+  return SUCCESS;
+}
+
+/*
+* NAME :        client_get_notify
+*
+* DESCRIPTION : Reports the notify hook of a client
+*
+* INPUTS :      client_id - ID of client
+*               notifyfnp - set to the hook, NULL when none is set
+*               argp - set to the argument of the hook
+*
+* OUTPUTS :     ERROR - failure or client not registered
+*               SUCCESS - Successful
+*
+* NOTES :       The value is a snapshot; another thread may replace the
+*               hook right after.
+*/
+int client_get_notify(
+  uint8_t client_id,
+  msg_notify_fn *notifyfnp,
+  void **argp)
+{
+  struct client_ctrl_s *client = client_find(client_id);
+
+  if (!client || !notifyfnp || !argp)
+  {
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  *notifyfnp = client->notifyfn;
+  *argp = client->notifyarg;
+  pthread_mutex_unlock(&client->lock);
+
+  return SUCCESS;
+}
+
+/*
+* NAME :        client_clear_notify
+*
+* DESCRIPTION : Removes the notify hook of a client if it is notifyfn with arg
+*
+* INPUTS :      client_id - ID of client
+*               notifyfn - hook to remove
+*               arg - its argument
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful, also when another hook was set
+*
+* NOTES :       Either way it returns once no notification with notifyfn and
+*               arg can still be running, so arg may be freed. A hook set
+*               by someone else is left in place. It must not be called from
+*               a notifyfn of the same client.
+*/
+int client_clear_notify(
+  uint8_t client_id,
+  msg_notify_fn notifyfn,
+  void *arg)
+{
+  struct client_ctrl_s *client = client_find(client_id);
+
+  if (!client)
+  {
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  if (client->notifyfn == notifyfn && client->notifyarg == arg)
+  {
+    notify_swap(client, NULL, NULL);
+  }
+  else
+  {
+    /* A swap that replaced the hook may still be waiting for it */
+    while (client->notifysetting)
+    {
+      pthread_cond_wait(&client->notifydone, &client->lock);
+    }
+  }
+  pthread_mutex_unlock(&client->lock);
+
+  return SUCCESS;
+}
+
+/*
+* NAME :        message_get_pool_stat
+*
+* DESCRIPTION : Reports the statistics of the message pool
+*
+* INPUTS :      statp - Buffer to fill
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       None
+*/
+int message_get_pool_stat(
+  mempool_stat_t *statp)
+{
+  return mempool_get_stat(&_message_pool, statp) ? SUCCESS : ERROR;
+}
+
+/*
+* NAME :        message_stat_dump
+*
+* DESCRIPTION : Writes message pool and client statistics as one JSON line
+*
+* INPUTS :      fp - Output stream
+*
+* OUTPUTS :     None
+*
+* NOTES :       Only registered clients are reported.
+*/
+void message_stat_dump(
+  FILE *fp)
+{
+  mempool_stat_t poolstat;
+  client_stat_t stat;
+  struct timespec now;
+  boolean first = TRUE;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  mempool_get_stat(&_message_pool, &poolstat);
+
+  fprintf(fp, "{\"ts_ns\":%llu,\"pool\":",
+          (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec);
+  mempool_dump_stat(fp, &poolstat);
+  fprintf(fp, ",\"clients\":[");
+
+  for (uint32_t i = 0; i <= MAX_CLIENT_255; i++)
+  {
+    if (SUCCESS != client_get_stat((uint8_t) i, &stat))
+    {
+      continue;
+    }
+
+    fprintf(fp, "%s{\"id\":%u,\"depth\":%u,\"limit\":%u,\"hwm\":%u,\"drops\":%u,"
+            "\"sends\":%llu,\"recvs\":%llu}",
+            first ? "" : ",", i, stat.depth, stat.limit, stat.hwm, stat.drops,
+            (unsigned long long) stat.sends, (unsigned long long) stat.recvs);
+    first = FALSE;
+  }
+
+  fprintf(fp, "]}\n");
+  fflush(fp);
+}
+
+/*
+* NAME :        stat_thread_fcn
+*
+* DESCRIPTION : Dumps statistics every stat_period_ms until stopped
+*
+* INPUTS :      arg - Not used
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API
+*/
+static void * stat_thread_fcn(
+  void *arg)
+{
+  struct timespec deadline;
+
+  pthread_mutex_lock(&stat_lock);
+  while (stat_running)
+  {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += stat_period_ms / 1000;
+    deadline.tv_nsec += (stat_period_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    if (ETIMEDOUT == pthread_cond_timedwait(&stat_cond, &stat_lock, &deadline))
+    {
+      message_stat_dump(stat_fp);
+    }
+  }
+  pthread_mutex_unlock(&stat_lock);
+
+  return NULL;
+}
+
+/*
+* NAME :        message_stat_start
+*
+* DESCRIPTION : Starts a thread that dumps statistics periodically
+*
+* INPUTS :      fp - Output stream
+*               period_ms - Dump period in milliseconds
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       Each dump is one JSON line, see message_stat_dump.
+*/
+int message_stat_start(
+  FILE *fp,
+  uint32_t period_ms)
+{
+  int res = ERROR;
+
+  if (!fp || 0 == period_ms)
+  {
+    printf("%s - Error: Invalid input parameters.\n", __func__);
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&stat_lock);
+  if (!stat_running)
+  {
+    stat_fp = fp;
+    stat_period_ms = period_ms;
+    stat_running = TRUE;
+    if (pthread_create(&stat_tid, NULL, stat_thread_fcn, NULL) == SUCCESS)
+    {
+      res = SUCCESS;
+    }
+    else
+    {
+      stat_running = FALSE;
+    }
+  }
+  pthread_mutex_unlock(&stat_lock);
+
+  return res;
+}
+
+/*
+* NAME :        message_stat_stop
+*
+* DESCRIPTION : Stops the periodic statistics dump
+*
+* INPUTS :      None
+*
+* OUTPUTS :     None
+*
+* NOTES :       None
+*/
+void message_stat_stop(
+  void)
+{
+  boolean running = FALSE;
+
+  pthread_mutex_lock(&stat_lock);
+  running = stat_running;
+  stat_running = FALSE;
+  pthread_cond_signal(&stat_cond);
+  pthread_mutex_unlock(&stat_lock);
+
+  if (running)
+  {
+    pthread_join(stat_tid, NULL);
+  }
+}
+
+/*
+* NAME :        chain_next
+*
+* DESCRIPTION : Returns the next block of a chained message
+*
+* INPUTS :      msg - block of a chained message
+*
+* OUTPUTS :     Next block or NULL for the last block
+*
+* NOTES :       None
+*/
+message_t * chain_next(
+  message_t *msg)
+{
+  if (!message_pool_of(msg))
+  {
+    return NULL;
+  }
+
+  return MSG_HEAD(msg)->nextp;
+}
+
+/*
+* NAME :        chain_len
+*
+* DESCRIPTION : Returns the number of payload bytes of a chained message
+*
+* INPUTS :      msg - first block
+*
+* OUTPUTS :     Sum of the len of all blocks
+*
+* NOTES :       None
+*/
+uint32_t chain_len(
+  message_t *msg)
+{
+  uint32_t len = 0;
+
+  for (; msg; msg = chain_next(msg))
+  {
+    len += msg->len;
+  }
+
+  return len;
+}
+
+/*
+* NAME :        chain_append
+*
+* DESCRIPTION : Appends bytes to a chained message, filling the last block
+*               before taking new blocks from the pool
+*
+* INPUTS :      msgp - first block, *msgp may be NULL to start a new chain
+*               data - bytes to append, NULL to append zeroes
+*               len - number of bytes
+*
+* OUTPUTS :     ERROR - failure, the chain is left as it was
+*               SUCCESS - Successful
+*
+* NOTES :       None
+*/
+int chain_append(
+  message_t **msgp,
+  const void *data,
+  uint32_t len)
+{
+  message_t *tailp = NULL;
+  message_t *newp = NULL;
+  message_t *lastp = NULL;
+  mempool_t *poolp = &_message_pool;
+  const uint8_t *srcp = (const uint8_t *) data;
+  uint32_t avail = 0;
+  uint32_t rest = len;
+  uint32_t n = 0;
+
+  if (!msgp)
+  {
+    printf("%s - Error: Invalid input parameters.\n", __func__);
+    return ERROR;
+  }
+
+  for (tailp = *msgp; tailp && chain_next(tailp); tailp = chain_next(tailp));
+
+  /* Take the extra blocks first so a failure leaves the chain untouched.
+  * They come from the pool of the chain's last block.
+  */
+  if (tailp)
+  {
+    poolp = message_pool_of(tailp);
+  }
+  /* A block filled past msg_size, e.g. through msg->len, takes no more */
+  avail = (tailp && tailp->len < _message_data_max) ? _message_data_max - tailp->len : 0;
+  while (rest > avail || (!tailp && !lastp))
+  {
+    message_t *blkp = message_alloc(poolp);
+
+    if (!blkp)
+    {
+      delete_message(newp);
+      return ERROR;
+    }
+
+    blkp->len = 0;
+    if (lastp)
+    {
+      MSG_HEAD(lastp)->nextp = blkp;
+    }
+    else
+    {
+      newp = blkp;
+    }
+    lastp = blkp;
+    avail += _message_data_max;
+  }
+
+  if (tailp)
+  {
+    MSG_HEAD(tailp)->nextp = newp;
+  }
+  else
+  {
+    *msgp = newp;
+    tailp = newp;
+  }
+
+  for (rest = len; rest; tailp = MSG_HEAD(tailp)->nextp)
+  {
+    n = tailp->len < _message_data_max ? _message_data_max - tailp->len : 0;
+    n = n < rest ? n : rest;
+    if (srcp)
+    {
+      memcpy(tailp->data + tailp->len, srcp, n);
+      srcp += n;
+    }
+    else
+    {
+      memset(tailp->data + tailp->len, 0, n);
+    }
+    tailp->len += n;
+    rest -= n;
+  }
+
+  return SUCCESS;
+}
+
+/*
+* NAME :        chain_iov
+*
+* DESCRIPTION : Describes the payload of a chained message as an iovec array
+*
+* INPUTS :      msg - first block
+*               iov - array to fill
+*               maxiov - size of iov
+*
+* OUTPUTS :     ERROR - failure, iov is too small
+*               Number of iovec entries used
+*
+* NOTES :       The entries point into the pool blocks, so they can be used
+*               to read or overwrite the payload in place, for example with
+*               readv/writev.
+*/
+int chain_iov(
+  message_t *msg,
+  struct iovec *iov,
+  int maxiov)
+{
+  int num = 0;
+
+  if (!iov)
+  {
+    return ERROR;
+  }
+
+  for (; msg; msg = chain_next(msg))
+  {
+    if (num == maxiov)
+    {
+      return ERROR;
+    }
+
+    iov[num].iov_base = msg->data;
+    iov[num].iov_len = msg->len;
+    num++;
+  }
+
+  return num;
+}
+
+/*
+* NAME :        chain_copy
+*
+* DESCRIPTION : Copies the payload of a chained message to a flat buffer
+*
+* INPUTS :      msg - first block
+*               buf - destination
+*               len - size of buf
+*
+* OUTPUTS :     Number of bytes copied
+*
+* NOTES :       None
+*/
+uint32_t chain_copy(
+  message_t *msg,
+  void *buf,
+  uint32_t len)
+{
+  uint8_t *dstp = (uint8_t *) buf;
+  uint32_t done = 0;
+  uint32_t n = 0;
+
+  for (; msg && done < len; msg = chain_next(msg))
+  {
+    n = msg->len < len - done ? msg->len : len - done;
+    memcpy(dstp + done, msg->data, n);
+    done += n;
+  }
+
+  return done;
+}
+
+/*
+* NAME :        chain_split
+*
+* DESCRIPTION : Splits a chained message in two at a byte offset
+*
+* INPUTS :      msg - first block
+*               offset - number of bytes kept in msg
+*
+* OUTPUTS :     First block of the second part, NULL if it is empty or on
+*               failure
+*
+* NOTES :       Blocks are moved, not copied. Only when offset falls inside a
+*               block is the end of that block copied into a new block, taken
+*               from the pool of that block.
+*/
+message_t * chain_split(
+  message_t *msg,
+  uint32_t offset)
+{
+  message_t *restp = NULL;
+  message_t *blkp = NULL;
+
+  /* Find the block holding offset */
+  while (msg && offset > msg->len)
+  {
+    offset -= msg->len;
+    msg = chain_next(msg);
+  }
+
+  if (!msg)
+  {
+    return NULL;
+  }
+
+  if (offset == msg->len)
+  {
+    restp = MSG_HEAD(msg)->nextp;
+    MSG_HEAD(msg)->nextp = NULL;
+    return restp;
+  }
+
+  blkp = message_alloc(message_pool_of(msg));
+  if (!blkp)
+  {
+    return NULL;
+  }
+
+  blkp->len = msg->len - offset;
+  memcpy(blkp->data, msg->data + offset, blkp->len);
+  MSG_HEAD(blkp)->nextp = MSG_HEAD(msg)->nextp;
+  MSG_HEAD(msg)->nextp = NULL;
+  msg->len = (uint8_t) offset;
+
+  return blkp;
+}
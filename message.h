@@ -1,6 +1,38 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
+#include <stdio.h>
 #include <stdint.h>
+#include <sys/uio.h>
+
+#include "mempool/mempool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Return codes of message service APIs */
+#define MSG_SUCCESS 0
+#define MSG_ERROR -1
+#define MSG_FULL -2
+#define MSG_TIMEOUT -3
+#define MSG_EMPTY -4
+
+/* Default number of messages that can be queued for a client */
+#define MSG_QUEUE_DEFAULT_LIMIT 8
+
+/* Mailbox priority lanes. Lane 0 is received first. */
+#define MSG_NUM_PRIO 4
+#define MSG_PRIO_HIGHEST 0
+#define MSG_PRIO_DEFAULT (MSG_NUM_PRIO - 1)
+
+/* Maximum number of calls waiting for a reply */
+#define MSG_MAX_CALLS 16
+
+/* Payload bytes of one message block */
+#define MSG_DATA_MAX 255
+
+/* Number of messages in the shared pool unless configured */
+#define MSG_POOL_DEFAULT_SIZE 20
 
 /*
 * NAME :        message_t
@@ -15,20 +47,256 @@
 typedef struct 
 {
   uint8_t len;
-  uint8_t data[255];
+  uint8_t data[MSG_DATA_MAX];
 } message_t;
 
+/*
+* NAME :        msg_policy_t
+*
+* DESCRIPTION : What send does when the destination's mailbox is full
+*
+* MEMBERS :     MSG_POLICY_BLOCK - Wait until the receiver frees a slot
+*               MSG_POLICY_FAIL - Return MSG_FULL immediately
+*               MSG_POLICY_DROP_OLDEST - Delete the oldest queued message of
+*                                        the lowest priority lane, or the new
+*                                        message if it has a lower priority
+*
+* NOTES :      None
+*/
+typedef enum
+{
+  MSG_POLICY_BLOCK,
+  MSG_POLICY_FAIL,
+  MSG_POLICY_DROP_OLDEST
+} msg_policy_t;
+
+/*
+* NAME :        client_stat_t
+*
+* DESCRIPTION : Snapshot of a client's mailbox
+*
+* MEMBERS :     depth - Number of queued messages
+*               limit - Maximum number of queued messages in all lanes
+*               hwm - Highest depth seen (high-water mark)
+*               drops - Messages dropped by MSG_POLICY_DROP_OLDEST
+*               credits - Slots still free for senders
+*               reserved - Slots reserved by credit_acquire
+*               sends - Messages queued to the client
+*               recvs - Messages taken by the client
+*
+* NOTES :      None
+*/
+typedef struct
+{
+  uint32_t depth;
+  uint32_t limit;
+  uint32_t hwm;
+  uint32_t drops;
+  uint32_t credits;
+  uint32_t reserved;
+  uint64_t sends;
+  uint64_t recvs;
+} client_stat_t;
+
+/*
+* NAME :        msg_client_config_t
+*
+* DESCRIPTION : Options of one client set by message_service_init
+*
+* MEMBERS :     client_id - ID of client
+*               limit - Mailbox capacity, 0 for MSG_QUEUE_DEFAULT_LIMIT
+*               policy - What send does when the mailbox is full
+*               pool_size - Blocks of a private pool for client_new_message,
+*                           0 to use the shared pool
+*
+* NOTES :      None
+*/
+typedef struct
+{
+  uint8_t client_id;
+  uint32_t limit;
+  msg_policy_t policy;
+  uint32_t pool_size;
+} msg_client_config_t;
+
+/*
+* NAME :        msg_config_t
+*
+* DESCRIPTION : Message service configuration
+*
+* MEMBERS :     pool_size - Blocks of the shared pool, 0 for
+*                           MSG_POOL_DEFAULT_SIZE
+*               msg_size - Payload bytes of a block, 0 for MSG_DATA_MAX;
+*                          longer payloads are chained
+*               pretouch - Fault in mailboxes during init; pool memory is
+*                          zeroed, and so faulted in, when it is created
+*               clientsp - Clients to register, may be NULL
+*               numclients - Number of entries in clientsp
+*
+* NOTES :      msg_size is the number of bytes chain_append puts in each
+*              block, message_data_max() returns it. Blocks still hold a whole
+*              message_t, so copying sizeof(message_t) is always safe.
+*/
+typedef struct
+{
+  uint32_t pool_size;
+  uint32_t msg_size;
+  boolean pretouch;
+  const msg_client_config_t *clientsp;
+  uint32_t numclients;
+} msg_config_t;
+
+/* Called on the sender's thread after a message is queued for client_id */
+typedef void (*msg_notify_fn)(uint8_t client_id, void *arg);
+
+
+extern int message_service_init(
+  const msg_config_t *configp);
 
 extern message_t * new_message(void);
 
+extern message_t * client_new_message(
+  uint8_t client_id);
+
+extern uint32_t message_data_max(void);
+
 extern void delete_message(message_t *msg);
 
 extern int send(
   uint8_t destination_id,
   message_t* msg);
 
+extern int send_prio(
+  uint8_t destination_id,
+  message_t* msg,
+  uint8_t prio);
+
+extern int send_durable(
+  uint8_t destination_id,
+  message_t* msg,
+  uint8_t prio);
+
+struct journal_s;
+extern void message_set_journal(
+  struct journal_s *jp);
+
+extern int send_after(
+  uint8_t destination_id,
+  message_t *msg,
+  uint8_t prio,
+  uint32_t delay_ms,
+  uint32_t *timeridp);
+
+extern int send_every(
+  uint8_t destination_id,
+  message_t *msg,
+  uint8_t prio,
+  uint32_t period_ms,
+  uint32_t *timeridp);
+
+extern int timer_cancel(
+  uint32_t timerid);
+
+extern void timer_stop(void);
+
 extern int recv(
   uint8_t receiver_id,
   message_t* msg);
 
-#endif
\ No newline at end of file
+extern int client_set_limit(
+  uint8_t client_id,
+  uint32_t limit,
+  msg_policy_t policy);
+
+extern int client_get_stat(
+  uint8_t client_id,
+  client_stat_t *statp);
+
+extern int send_credits(
+  uint8_t destination_id);
+
+extern int credit_acquire(
+  uint8_t destination_id,
+  uint32_t num_credits);
+
+extern int credit_release(
+  uint8_t destination_id,
+  uint32_t num_credits);
+
+extern int send_with_credit(
+  uint8_t destination_id,
+  message_t* msg);
+
+extern int call(
+  uint8_t destination_id,
+  message_t *req,
+  message_t **reply,
+  int32_t timeout_ms);
+
+extern int reply(
+  message_t *req,
+  message_t *resp);
+
+extern uint32_t message_corrid(
+  message_t *msg);
+
+extern int try_recv(
+  uint8_t receiver_id,
+  message_t **msg);
+
+extern int client_set_notify(
+  uint8_t client_id,
+  msg_notify_fn notifyfn,
+  void *arg);
+
+extern int client_get_notify(
+  uint8_t client_id,
+  msg_notify_fn *notifyfnp,
+  void **argp);
+
+extern int client_clear_notify(
+  uint8_t client_id,
+  msg_notify_fn notifyfn,
+  void *arg);
+
+extern int message_get_pool_stat(
+  mempool_stat_t *statp);
+
+extern void message_stat_dump(
+  FILE *fp);
+
+extern int message_stat_start(
+  FILE *fp,
+  uint32_t period_ms);
+
+extern void message_stat_stop(void);
+
+extern message_t * chain_next(
+  message_t *msg);
+
+extern uint32_t chain_len(
+  message_t *msg);
+
+extern int chain_append(
+  message_t **msgp,
+  const void *data,
+  uint32_t len);
+
+extern int chain_iov(
+  message_t *msg,
+  struct iovec *iov,
+  int maxiov);
+
+extern uint32_t chain_copy(
+  message_t *msg,
+  void *buf,
+  uint32_t len);
+
+extern message_t * chain_split(
+  message_t *msg,
+  uint32_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
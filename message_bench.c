@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "message.h"
+
+#define MAX_THREADS 16
+#define DEFAULT_ITERS 20000
+#define MAX_TOKENS 8
+
+static const uint32_t msg_sizes[] = {8, 64, 255};
+static const uint32_t ring_lengths[] = {2, 4, 8};
+/* Queued messages plus one held by each thread must fit the message pool */
+static const uint32_t producer_counts[] = {1, 2, 4, 8};
+
+/*
+* NAME :        bench_s
+*
+* DESCRIPTION : State shared by the threads of one benchmark run
+*
+* MEMBERS :     barrier - Start barrier of all threads
+*               numthr - Number of benchmark threads
+*               msgsize - Payload bytes written and read per message
+*               iters - Round trips, hops per token or messages per producer
+*               samplesp - Round trip times in nanoseconds
+*               startns - When each thread passed the barrier
+*               endns - When the measured work finished
+*
+* NOTES :      None
+*/
+struct bench_s
+{
+  pthread_barrier_t barrier;
+  uint32_t numthr;
+  uint32_t msgsize;
+  uint64_t iters;
+  uint64_t *samplesp;
+  uint64_t startns[MAX_THREADS];
+  uint64_t endns;
+};
+
+struct thread_arg_s
+{
+  struct bench_s *benchp;
+  uint32_t idx;
+};
+
+static boolean json = FALSE;
+static boolean first = TRUE;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+* NAME :        bench_recv
+*
+* DESCRIPTION : Receives a message and reads its payload
+*
+* INPUTS :      id - Receiving client
+*
+* OUTPUTS :     Received message
+*
+* NOTES :       None
+*/
+static message_t * bench_recv(uint8_t id)
+{
+  message_t **slotp = NULL;
+  volatile uint8_t sum = 0;
+
+  if (recv(id, (message_t *) &slotp) != 0)
+  {
+    return NULL;
+  }
+
+  for (uint32_t i = 0; i < (*slotp)->len; i++)
+  {
+    sum += (*slotp)->data[i];
+  }
+
+  return *slotp;
+}
+
+/*
+* NAME :        bench_new
+*
+* DESCRIPTION : Gets a new message and writes its payload
+*
+* INPUTS :      size - Payload bytes
+*
+* OUTPUTS :     New message
+*
+* NOTES :       None
+*/
+static message_t * bench_new(uint32_t size)
+{
+  message_t *msg = new_message();
+
+  if (msg)
+  {
+    memset(msg->data, 0x5A, size);
+    msg->len = (uint8_t) size;
+  }
+
+  return msg;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+* NAME :        report
+*
+* DESCRIPTION : Prints one result row
+*
+* INPUTS :      test - Test name
+*               benchp - Finished benchmark run
+*               ops - Number of messages delivered
+*               numsamples - Number of latency samples, 0 if none
+*
+* OUTPUTS :     None
+*
+* NOTES :       Elapsed time runs from the first thread passing the barrier
+*               to the end of the measured work.
+*/
+static void report(
+  const char *test,
+  struct bench_s *benchp,
+  uint64_t ops,
+  uint64_t numsamples)
+{
+  uint64_t start = UINT64_MAX;
+  uint64_t p50 = 0, p99 = 0, p999 = 0;
+  double mops = 0;
+
+  for (uint32_t i = 0; i < benchp->numthr; i++)
+  {
+    start = benchp->startns[i] < start ? benchp->startns[i] : start;
+  }
+  mops = ops * 1000.0 / (benchp->endns - start);
+
+  if (numsamples)
+  {
+    qsort(benchp->samplesp, numsamples, sizeof(uint64_t), cmp_u64);
+    p50 = benchp->samplesp[numsamples * 50 / 100];
+    p99 = benchp->samplesp[numsamples * 99 / 100];
+    p999 = benchp->samplesp[numsamples * 999 / 1000];
+  }
+
+  if (json)
+  {
+    printf("%s{\"test\":\"%s\",\"threads\":%u,\"msg_size\":%u,\"ops\":%llu,\"mops\":%.4f,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}",
+           first ? "" : ",\n", test, benchp->numthr, benchp->msgsize,
+           (unsigned long long) ops, mops, (unsigned long long) p50,
+           (unsigned long long) p99, (unsigned long long) p999);
+  }
+  else
+  {
+    printf("%s,%u,%u,%llu,%.4f,%llu,%llu,%llu\n", test, benchp->numthr, benchp->msgsize,
+           (unsigned long long) ops, mops, (unsigned long long) p50,
+           (unsigned long long) p99, (unsigned long long) p999);
+  }
+  first = FALSE;
+  fflush(stdout);
+}
+
+/*
+* NAME :        pingpong_fcn
+*
+* DESCRIPTION : Thread 0 sends to thread 1 and waits for the same message to
+*               come back, timing every round trip. Thread 1 echoes.
+*
+* INPUTS :      arg - struct thread_arg_s
+*
+* OUTPUTS :     None
+*
+* NOTES :       Client IDs are the thread indexes.
+*/
+static void * pingpong_fcn(void *arg)
+{
+  struct thread_arg_s *argp = (struct thread_arg_s *) arg;
+  struct bench_s *benchp = argp->benchp;
+  message_t *msg = NULL;
+  uint64_t start = 0;
+
+  pthread_barrier_wait(&benchp->barrier);
+  benchp->startns[argp->idx] = now_ns();
+
+  for (uint64_t i = 0; i < benchp->iters; i++)
+  {
+    if (0 == argp->idx)
+    {
+      msg = bench_new(benchp->msgsize);
+      start = now_ns();
+      send(1, msg);
+      msg = bench_recv(0);
+      benchp->samplesp[i] = now_ns() - start;
+      delete_message(msg);
+    }
+    else
+    {
+      msg = bench_recv(1);
+      send(0, msg);
+    }
+  }
+
+  if (0 == argp->idx)
+  {
+    benchp->endns = now_ns();
+  }
+
+  return NULL;
+}
+
+/*
+* NAME :        ring_fcn
+*
+* DESCRIPTION : Forwards tokens to the next thread of the ring. The first
+*               4 bytes of a token count its remaining hops; a token with no
+*               hops left is deleted. An empty message stops the thread.
+*
+* INPUTS :      arg - struct thread_arg_s
+*
+* OUTPUTS :     None
+*
+* NOTES :       None
+*/
+static void * ring_fcn(void *arg)
+{
+  struct thread_arg_s *argp = (struct thread_arg_s *) arg;
+  struct bench_s *benchp = argp->benchp;
+  uint8_t next = (uint8_t) ((argp->idx + 1) % benchp->numthr);
+  message_t *msg = NULL;
+  uint32_t hops = 0;
+
+  pthread_barrier_wait(&benchp->barrier);
+  benchp->startns[argp->idx] = now_ns();
+
+  while (1)
+  {
+    msg = bench_recv((uint8_t) argp->idx);
+    if (!msg || 0 == msg->len)
+    {
+      delete_message(msg);
+      break;
+    }
+
+    memcpy(&hops, msg->data, sizeof(hops));
+    if (0 == --hops)
+    {
+      delete_message(msg);
+      if (__atomic_sub_fetch(&benchp->iters, 1, __ATOMIC_ACQ_REL) == 0)
+      {
+        benchp->endns = now_ns();
+      }
+      continue;
+    }
+
+    memcpy(msg->data, &hops, sizeof(hops));
+    send(next, msg);
+  }
+
+  return NULL;
+}
+
+/*
+* NAME :        fanin_fcn
+*
+* DESCRIPTION : Thread 0 receives everything the other threads send to it
+*
+* INPUTS :      arg - struct thread_arg_s
+*
+* OUTPUTS :     None
+*
+* NOTES :       None
+*/
+static void * fanin_fcn(void *arg)
+{
+  struct thread_arg_s *argp = (struct thread_arg_s *) arg;
+  struct bench_s *benchp = argp->benchp;
+  uint64_t total = benchp->iters * (benchp->numthr - 1);
+
+  pthread_barrier_wait(&benchp->barrier);
+  benchp->startns[argp->idx] = now_ns();
+
+  if (0 == argp->idx)
+  {
+    for (uint64_t i = 0; i < total; i++)
+    {
+      delete_message(bench_recv(0));
+    }
+    benchp->endns = now_ns();
+  }
+  else
+  {
+    for (uint64_t i = 0; i < benchp->iters; i++)
+    {
+      send(0, bench_new(benchp->msgsize));
+    }
+  }
+
+  return NULL;
+}
+
+/*
+* NAME :        bench_start
+*
+* DESCRIPTION : Registers clients 0 .. numthr-1 and starts the threads
+*
+* INPUTS :      benchp - Benchmark run
+*               fcn - Thread function
+*               tid - Buffer for thread IDs
+*               args - Buffer for thread arguments
+*
+* OUTPUTS :     None
+*
+* NOTES :       Clients are registered before any thread starts, so no send
+*               can reach an unregistered client. The threads then start
+*               together on the barrier.
+*/
+static void bench_start(
+  struct bench_s *benchp,
+  void * (*fcn)(void *),
+  pthread_t *tid,
+  struct thread_arg_s *args)
+{
+  for (uint32_t i = 0; i < benchp->numthr; i++)
+  {
+    client_set_notify((uint8_t) i, NULL, NULL);
+  }
+
+  pthread_barrier_init(&benchp->barrier, NULL, benchp->numthr);
+  for (uint32_t i = 0; i < benchp->numthr; i++)
+  {
+    args[i].benchp = benchp;
+    args[i].idx = i;
+    pthread_create(&tid[i], NULL, fcn, &args[i]);
+  }
+}
+
+static void bench_join(
+  struct bench_s *benchp,
+  pthread_t *tid)
+{
+  for (uint32_t i = 0; i < benchp->numthr; i++)
+  {
+    pthread_join(tid[i], NULL);
+  }
+  pthread_barrier_destroy(&benchp->barrier);
+}
+
+static void run_pingpong(uint32_t msgsize, uint64_t iters)
+{
+  struct bench_s bench = {0};
+  pthread_t tid[MAX_THREADS];
+  struct thread_arg_s args[MAX_THREADS];
+
+  bench.numthr = 2;
+  bench.msgsize = msgsize;
+  bench.iters = iters;
+  bench.samplesp = (uint64_t *) calloc(iters, sizeof(uint64_t));
+
+  bench_start(&bench, pingpong_fcn, tid, args);
+  bench_join(&bench, tid);
+
+  report("pingpong", &bench, 2 * iters, iters);
+  free(bench.samplesp);
+}
+
+static void run_ring(uint32_t length, uint32_t msgsize, uint64_t hops)
+{
+  struct bench_s bench = {0};
+  pthread_t tid[MAX_THREADS];
+  struct thread_arg_s args[MAX_THREADS];
+  uint32_t numtokens = length < MAX_TOKENS ? length : MAX_TOKENS;
+  uint32_t tokenhops = (uint32_t) (hops / numtokens);
+  message_t *msg = NULL;
+
+  bench.numthr = length;
+  bench.msgsize = msgsize;
+  bench.iters = numtokens;
+
+  bench_start(&bench, ring_fcn, tid, args);
+
+  /* Tokens start at evenly spaced stages of the ring */
+  for (uint32_t i = 0; i < numtokens; i++)
+  {
+    msg = bench_new(msgsize);
+    memcpy(msg->data, &tokenhops, sizeof(tokenhops));
+    send((uint8_t) (i * length / numtokens), msg);
+  }
+
+  while (__atomic_load_n(&bench.iters, __ATOMIC_ACQUIRE))
+  {
+    usleep(1000);
+  }
+
+  for (uint32_t i = 0; i < length; i++)
+  {
+    msg = new_message();
+    msg->len = 0;
+    send((uint8_t) i, msg);
+  }
+  bench_join(&bench, tid);
+
+  report("ring", &bench, (uint64_t) tokenhops * numtokens, 0);
+}
+
+static void run_fanin(uint32_t producers, uint32_t msgsize, uint64_t iters)
+{
+  struct bench_s bench = {0};
+  pthread_t tid[MAX_THREADS];
+  struct thread_arg_s args[MAX_THREADS];
+
+  bench.numthr = producers + 1;
+  bench.msgsize = msgsize;
+  bench.iters = iters;
+
+  bench_start(&bench, fanin_fcn, tid, args);
+  bench_join(&bench, tid);
+
+  report("fanin", &bench, iters * producers, 0);
+}
+
+static void usage(const char *name)
+{
+  printf("Usage: %s [-j] [-n iterations]\n"
+         "  -j  JSON output instead of CSV\n"
+         "  -n  round trips, ring hops and messages per producer (default %d)\n",
+         name, DEFAULT_ITERS);
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t iters = DEFAULT_ITERS;
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "jn:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'j':
+        json = TRUE;
+        break;
+      case 'n':
+        iters = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (json)
+  {
+    printf("[\n");
+  }
+  else
+  {
+    printf("test,threads,msg_size,ops,mops,p50_ns,p99_ns,p999_ns\n");
+  }
+
+  for (uint32_t s = 0; s < sizeof(msg_sizes) / sizeof(msg_sizes[0]); s++)
+  {
+    run_pingpong(msg_sizes[s], iters);
+
+    for (uint32_t r = 0; r < sizeof(ring_lengths) / sizeof(ring_lengths[0]); r++)
+    {
+      run_ring(ring_lengths[r], msg_sizes[s], iters);
+    }
+
+    for (uint32_t p = 0; p < sizeof(producer_counts) / sizeof(producer_counts[0]); p++)
+    {
+      run_fanin(producer_counts[p], msg_sizes[s], iters);
+    }
+  }
+
+  if (json)
+  {
+    printf("\n]\n");
+  }
+
+  return 0;
+}
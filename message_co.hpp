@@ -0,0 +1,324 @@
+#ifndef MESSAGE_CO_HPP
+#define MESSAGE_CO_HPP
+#include <coroutine>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
+
+#include "message.h"
+
+/*
+* C++20 coroutine layer over the message service.
+*
+* A msg_executor runs coroutines on the thread calling run(). co_recv
+* suspends a coroutine instead of blocking a thread in recv; the executor
+* is woken through the client_set_notify hook when a message is sent to
+* the client and resumes the coroutine waiting for it. Thousands of
+* receive loops can share one thread this way.
+*/
+
+class msg_executor;
+
+/*
+* NAME :        msg_task
+*
+* DESCRIPTION : Fire-and-forget coroutine started with msg_executor::spawn
+*
+* NOTES :       The coroutine frame is destroyed when the coroutine returns.
+*               An escaping exception terminates the program.
+*/
+struct msg_task
+{
+  struct promise_type
+  {
+    msg_executor *execp = nullptr;
+
+    msg_task get_return_object()
+    {
+      return msg_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+    ~promise_type();
+  };
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+/*
+* NAME :        msg_recv_awaiter
+*
+* DESCRIPTION : Awaitable returned by co_recv, yields the received message
+*
+* MEMBERS :     client_id - Client to receive for
+*               msg - Received message
+*               handle - Suspended coroutine
+*
+* NOTES :       Only one coroutine may wait for a client at a time.
+*/
+struct msg_recv_awaiter
+{
+  uint8_t client_id;
+  message_t *msg = nullptr;
+  std::coroutine_handle<> handle;
+
+  bool await_ready()
+  {
+    return MSG_SUCCESS == try_recv(client_id, &msg);
+  }
+  bool await_suspend(std::coroutine_handle<> h);
+  message_t * await_resume() { return msg; }
+};
+
+/*
+* NAME :        msg_executor
+*
+* DESCRIPTION : Single-threaded executor for message service coroutines
+*
+* MEMBERS :     lock - Protects the ready queues
+*               cond - Wakes run() when work is queued
+*               ready - Coroutines to start
+*               woken - Clients that got a message, each queued once
+*               pending[] - Client is in woken
+*               waiter[] - Coroutine waiting in co_recv for each client
+*               attached[] - This executor set the client's notify hook
+*               live - Spawned coroutines that have not returned
+*               stopped - run() returns when set
+*
+* NOTES :       spawn, run and co_recv must be used on the executor's
+*               thread. Senders may run on any thread. The destructor waits
+*               for notifications running on sender threads and destroys
+*               the coroutines still waiting in co_recv or not started,
+*               as after stop(). Coroutines suspended on anything else
+*               must have returned before.
+*/
+class msg_executor
+{
+public:
+  msg_executor() = default;
+  msg_executor(const msg_executor &) = delete;
+  msg_executor & operator=(const msg_executor &) = delete;
+
+  /* Removes the hooks still pointing here and waits until no sender
+  * thread is inside notify_fcn with this executor, then destroys the
+  * coroutines that would never be resumed.
+  */
+  ~msg_executor()
+  {
+    std::deque<std::coroutine_handle<>> frames;
+
+    for (uint32_t i = 0; i < MAX_CLIENTS; i++)
+    {
+      if (attached[i])
+      {
+        client_clear_notify((uint8_t) i, notify_fcn, this);
+      }
+    }
+
+    /* Each frame's promise takes the lock when it is destroyed */
+    {
+      std::lock_guard<std::mutex> guard(lock);
+
+      frames.swap(ready);
+      for (uint32_t i = 0; i < MAX_CLIENTS; i++)
+      {
+        if (waiter[i])
+        {
+          frames.push_back(waiter[i]->handle);
+          waiter[i] = nullptr;
+        }
+      }
+    }
+    for (std::coroutine_handle<> h : frames)
+    {
+      h.destroy();
+    }
+  }
+
+  /* Queues a coroutine; it starts when run() reaches it */
+  void spawn(msg_task task)
+  {
+    task.handle.promise().execp = this;
+    std::lock_guard<std::mutex> guard(lock);
+    live++;
+    ready.push_back(task.handle);
+    cond.notify_one();
+  }
+
+  /* Runs coroutines until all of them returned or stop() is called */
+  void run()
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    msg_executor *prevp = current_executor;
+
+    current_executor = this;
+    while (live && !stopped)
+    {
+      if (!ready.empty())
+      {
+        std::coroutine_handle<> h = ready.front();
+
+        ready.pop_front();
+        guard.unlock();
+        h.resume();
+        guard.lock();
+      }
+      else if (!woken.empty())
+      {
+        uint8_t client_id = woken.front();
+
+        woken.pop_front();
+        pending[client_id] = false;
+        guard.unlock();
+        deliver(client_id);
+        guard.lock();
+      }
+      else
+      {
+        cond.wait(guard);
+      }
+    }
+    stopped = false;
+    current_executor = prevp;
+  }
+
+  /* Makes run() return, may be called from any thread */
+  void stop()
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopped = true;
+    cond.notify_one();
+  }
+
+  /* Executor running on this thread, nullptr outside run() */
+  static msg_executor * current()
+  {
+    return current_executor;
+  }
+
+private:
+  friend struct msg_task::promise_type;
+  friend struct msg_recv_awaiter;
+
+  static constexpr uint32_t MAX_CLIENTS = 256;
+
+  /* Runs on the sender's thread after a message is queued */
+  static void notify_fcn(uint8_t client_id, void *arg)
+  {
+    msg_executor *execp = static_cast<msg_executor *>(arg);
+    std::lock_guard<std::mutex> guard(execp->lock);
+
+    if (!execp->pending[client_id])
+    {
+      execp->pending[client_id] = true;
+      execp->woken.push_back(client_id);
+      execp->cond.notify_one();
+    }
+  }
+
+  /* Resumes the coroutine waiting for a client if a message is there.
+  * A wake-up for a message already taken by await_ready finds the
+  * mailbox empty and leaves the waiter in place.
+  */
+  void deliver(uint8_t client_id)
+  {
+    msg_recv_awaiter *awaiterp = waiter[client_id];
+
+    if (awaiterp && MSG_SUCCESS == try_recv(client_id, &awaiterp->msg))
+    {
+      waiter[client_id] = nullptr;
+      awaiterp->handle.resume();
+    }
+  }
+
+  /* Registers a waiting coroutine, false if a message came meanwhile or
+  * the client's hook belongs to someone else (msg is then nullptr).
+  */
+  bool wait(msg_recv_awaiter *awaiterp)
+  {
+    uint8_t client_id = awaiterp->client_id;
+    msg_notify_fn notifyfn = NULL;
+    void *arg = nullptr;
+
+    /* Attach a client without a hook, also after its hook was removed */
+    if (MSG_SUCCESS != client_get_notify(client_id, &notifyfn, &arg) || !notifyfn)
+    {
+      if (MSG_SUCCESS != client_set_notify(client_id, notify_fcn, this))
+      {
+        std::terminate();
+      }
+      attached[client_id] = true;
+    }
+    else if (notifyfn != notify_fcn || arg != this)
+    {
+      printf("%s - Error: Client %u has another notify hook.\n", __func__, client_id);
+      awaiterp->msg = nullptr;
+      return false;
+    }
+
+    /* A message queued before the notify hook was set sent no wake-up */
+    if (MSG_SUCCESS == try_recv(client_id, &awaiterp->msg))
+    {
+      return false;
+    }
+    waiter[client_id] = awaiterp;
+
+    return true;
+  }
+
+  std::mutex lock;
+  std::condition_variable cond;
+  std::deque<std::coroutine_handle<>> ready;
+  std::deque<uint8_t> woken;
+  bool pending[MAX_CLIENTS] = {};
+  msg_recv_awaiter *waiter[MAX_CLIENTS] = {};
+  bool attached[MAX_CLIENTS] = {};
+  uint32_t live = 0;
+  bool stopped = false;
+
+  static inline thread_local msg_executor *current_executor = nullptr;
+};
+
+inline msg_task::promise_type::~promise_type()
+{
+  if (execp)
+  {
+    std::lock_guard<std::mutex> guard(execp->lock);
+    execp->live--;
+  }
+}
+
+inline bool msg_recv_awaiter::await_suspend(
+  std::coroutine_handle<> h)
+{
+  handle = h;
+
+  return msg_executor::current()->wait(this);
+}
+
+/*
+* NAME :        co_recv
+*
+* DESCRIPTION : Receives a message without blocking the thread
+*
+* INPUTS :      client_id - ID of client
+*
+* OUTPUTS :     Awaitable yielding the message; delete it with delete_message.
+*               It yields nullptr if the client's notify hook belongs to
+*               another executor or to dispatcher_register.
+*
+* NOTES :       Must be awaited by a coroutine running on a msg_executor.
+*               co_recv attaches the client to the executor with
+*               client_set_notify when the client has no hook.
+*/
+inline msg_recv_awaiter co_recv(
+  uint8_t client_id)
+{
+  return msg_recv_awaiter{client_id};
+}
+
+#endif
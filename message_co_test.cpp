@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+
+#include "message_co.hpp"
+
+#define PING_ID 1
+#define PONG_ID 2
+#define HOOK_ID 3
+#define NUM_ROUNDS 1000
+#define SLOW_NOTIFY_MS 50
+#define NUM_EXECUTORS 20
+#define OWNED_ID 4
+#define IDLE_ID 5
+
+#define FIRST_LOOP_ID 10
+#define NUM_LOOPS 200
+#define NUM_MSG_PER_LOOP 5
+#define MAX_IN_FLIGHT 16
+
+static uint32_t pongs = 0;
+static std::atomic<uint32_t> received{0};
+static uint32_t loop_count[NUM_LOOPS];
+static std::atomic<bool> notify_started{false};
+static std::atomic<bool> notify_done{false};
+static uint32_t frames_destroyed = 0;
+
+/*
+* NAME :        frame_guard
+*
+* DESCRIPTION : Counts the coroutine frames destroyed with it in scope
+*
+*/
+struct frame_guard
+{
+  ~frame_guard()
+  {
+    frames_destroyed++;
+  }
+};
+
+/*
+* NAME :        seq_message
+*
+* DESCRIPTION : Creates a message carrying a sequence number
+*
+* INPUTS :      seq - sequence number
+*
+* OUTPUTS :     New message
+*
+*/
+static message_t * seq_message(uint32_t seq)
+{
+  message_t *msg = new_message();
+
+  assert(msg);
+  memcpy(msg->data, &seq, sizeof(seq));
+  msg->len = sizeof(seq);
+
+  return msg;
+}
+
+/*
+* NAME :        msg_seq
+*
+* DESCRIPTION : Reads the sequence number of a message and deletes it
+*
+* INPUTS :      msg - message
+*
+* OUTPUTS :     Sequence number
+*
+*/
+static uint32_t msg_seq(message_t *msg)
+{
+  uint32_t seq = 0;
+
+  memcpy(&seq, msg->data, sizeof(seq));
+  delete_message(msg);
+
+  return seq;
+}
+
+/*
+* NAME :        slow_notify
+*
+* DESCRIPTION : Notify hook that takes SLOW_NOTIFY_MS to return
+*
+* INPUTS :      client_id - ID of client
+*               arg - Not used
+*
+* OUTPUTS :     None
+*
+*/
+static void slow_notify(uint8_t client_id, void *arg)
+{
+  notify_started = true;
+  usleep(SLOW_NOTIFY_MS * 1000);
+  notify_done = true;
+}
+
+/*
+* NAME :        slow_send
+*
+* DESCRIPTION : Sends to HOOK_ID from another thread and waits until the
+*               hook is running
+*
+* INPUTS :      None
+*
+* OUTPUTS :     Sender thread
+*
+*/
+static std::thread slow_send()
+{
+  notify_started = false;
+  notify_done = false;
+  std::thread sender([]()
+  {
+    assert(0 == send(HOOK_ID, seq_message(0)));
+  });
+
+  while (!notify_started)
+  {
+    sched_yield();
+  }
+
+  return sender;
+}
+
+/*
+* NAME :        ping_task
+*
+* DESCRIPTION : Sends NUM_ROUNDS pings and waits for each pong
+*
+*/
+static msg_task ping_task()
+{
+  for (uint32_t i = 0; i < NUM_ROUNDS; i++)
+  {
+    assert(0 == send(PONG_ID, seq_message(i)));
+    assert(i == msg_seq(co_await co_recv(PING_ID)));
+    pongs++;
+  }
+}
+
+/*
+* NAME :        pong_task
+*
+* DESCRIPTION : Answers every ping with the same sequence number
+*
+*/
+static msg_task pong_task()
+{
+  for (uint32_t i = 0; i < NUM_ROUNDS; i++)
+  {
+    uint32_t seq = msg_seq(co_await co_recv(PONG_ID));
+
+    assert(i == seq);
+    assert(0 == send(PING_ID, seq_message(seq)));
+  }
+}
+
+/*
+* NAME :        loop_task
+*
+* DESCRIPTION : Receive loop of one client, checks the message order
+*
+*/
+static msg_task loop_task(uint32_t idx)
+{
+  for (uint32_t i = 0; i < NUM_MSG_PER_LOOP; i++)
+  {
+    assert(i == msg_seq(co_await co_recv(FIRST_LOOP_ID + idx)));
+    loop_count[idx]++;
+    received++;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  msg_executor exec;
+
+  printf("Testing co_recv ping-pong on one thread");
+  exec.spawn(pong_task());
+  exec.spawn(ping_task());
+  exec.run();
+  assert(NUM_ROUNDS == pongs);
+  printf("... PASSED\n");
+
+  /* ping_task attached PING_ID; the executor sets its hook again */
+  printf("Testing co_recv after its hook was removed");
+  assert(0 == client_set_notify(PING_ID, NULL, NULL));
+  exec.spawn([]() -> msg_task
+  {
+    assert(7 == msg_seq(co_await co_recv(PING_ID)));
+  }());
+  std::thread late_sender([]()
+  {
+    usleep(20 * 1000);
+    assert(0 == send(PING_ID, seq_message(7)));
+  });
+  exec.run();
+  late_sender.join();
+  printf("... PASSED\n");
+
+  printf("Testing co_recv with a message already queued");
+  assert(0 == client_set_notify(PONG_ID, NULL, NULL));
+  assert(0 == send(PONG_ID, seq_message(0)));
+  exec.spawn([]() -> msg_task
+  {
+    assert(0 == msg_seq(co_await co_recv(PONG_ID)));
+  }());
+  exec.run();
+  printf("... PASSED\n");
+
+  /* Clients are registered up front so the sender never finds them missing;
+  * the loops attach to the executor when they first wait.
+  */
+  printf("Testing %d receive loops woken by another thread", NUM_LOOPS);
+  for (uint32_t i = 0; i < NUM_LOOPS; i++)
+  {
+    assert(0 == client_set_notify(FIRST_LOOP_ID + i, NULL, NULL));
+    exec.spawn(loop_task(i));
+  }
+
+  std::thread sender([]()
+  {
+    for (uint32_t seq = 0; seq < NUM_MSG_PER_LOOP; seq++)
+    {
+      for (uint32_t i = 0; i < NUM_LOOPS; i++)
+      {
+        while (seq * NUM_LOOPS + i - received.load() >= MAX_IN_FLIGHT)
+        {
+          sched_yield();
+        }
+        assert(0 == send(FIRST_LOOP_ID + i, seq_message(seq)));
+      }
+    }
+  });
+
+  exec.run();
+  sender.join();
+  for (uint32_t i = 0; i < NUM_LOOPS; i++)
+  {
+    assert(NUM_MSG_PER_LOOP == loop_count[i]);
+  }
+  printf("... PASSED\n");
+
+  printf("Testing hook removal waits for running notifications");
+  message_t *msg = nullptr;
+  msg_notify_fn notifyfn = NULL;
+  void *arg = nullptr;
+
+  assert(0 == client_set_notify(HOOK_ID, slow_notify, &exec));
+  std::thread hook_sender = slow_send();
+  assert(0 == client_set_notify(HOOK_ID, NULL, NULL));
+  assert(notify_done);
+  hook_sender.join();
+
+  /* Only the matching hook is cleared */
+  assert(0 == client_set_notify(HOOK_ID, slow_notify, &exec));
+  assert(0 == client_clear_notify(HOOK_ID, slow_notify, &pongs));
+  assert(0 == client_get_notify(HOOK_ID, &notifyfn, &arg));
+  assert(slow_notify == notifyfn && &exec == arg);
+  hook_sender = slow_send();
+  assert(0 == client_clear_notify(HOOK_ID, slow_notify, &exec));
+  assert(notify_done);
+  assert(0 == client_get_notify(HOOK_ID, &notifyfn, &arg));
+  assert(NULL == notifyfn);
+  hook_sender.join();
+  while (0 == try_recv(HOOK_ID, &msg))
+  {
+    delete_message(msg);
+  }
+  printf("... PASSED\n");
+
+  /* Each executor is deleted while a sender thread keeps notifying it */
+  printf("Testing executor destroyed during notifications");
+  for (uint32_t i = 0; i < NUM_EXECUTORS; i++)
+  {
+    msg_executor *execp = new msg_executor;
+    std::atomic<bool> stop{false};
+
+    execp->spawn([]() -> msg_task
+    {
+      delete_message(co_await co_recv(HOOK_ID));
+    }());
+    std::thread flood([&stop]()
+    {
+      message_t *floodp = nullptr;
+
+      while (!stop)
+      {
+        assert(0 == send(HOOK_ID, seq_message(0)));
+        while (0 == try_recv(HOOK_ID, &floodp))
+        {
+          delete_message(floodp);
+        }
+      }
+    });
+
+    execp->run();
+    delete execp;
+    assert(0 == client_get_notify(HOOK_ID, &notifyfn, &arg));
+    assert(NULL == notifyfn);
+    stop = true;
+    flood.join();
+  }
+  while (0 == try_recv(HOOK_ID, &msg))
+  {
+    delete_message(msg);
+  }
+  printf("... PASSED\n");
+
+  /* OWNED_ID belongs to exec; another executor must not take it */
+  printf("Testing co_recv on a client attached to another executor");
+  exec.spawn([]() -> msg_task
+  {
+    msg_executor::current()->stop();
+    co_await co_recv(OWNED_ID);
+  }());
+  exec.run();
+  assert(0 == client_get_notify(OWNED_ID, &notifyfn, &arg));
+  assert(&exec == arg);
+  {
+    msg_executor other;
+
+    other.spawn([]() -> msg_task
+    {
+      assert(nullptr == co_await co_recv(OWNED_ID));
+    }());
+    other.run();
+  }
+  assert(0 == client_get_notify(OWNED_ID, &notifyfn, &arg));
+  assert(&exec == arg);
+  printf("... PASSED\n");
+
+  /* One coroutine waits in co_recv and one never started when the
+  * executor goes away; both frames are destroyed with it.
+  */
+  printf("Testing executor destroyed with suspended coroutines");
+  {
+    msg_executor idle;
+
+    idle.spawn([]() -> msg_task
+    {
+      frame_guard guard;
+
+      msg_executor::current()->stop();
+      co_await co_recv(IDLE_ID);
+      assert(!"resumed after stop");
+    }());
+    idle.run();
+    idle.spawn([](frame_guard guard) -> msg_task
+    {
+      co_return;
+    }(frame_guard()));
+    frames_destroyed = 0;
+  }
+  assert(2 == frames_destroyed);
+  assert(0 == client_get_notify(IDLE_ID, &notifyfn, &arg));
+  assert(NULL == notifyfn);
+  printf("... PASSED\n");
+
+  return 0;
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include "message.h"
+
+#define POOL_SIZE 100
+#define MSG_SIZE 64
+#define PRIVATE_ID 3
+#define PRIVATE_POOL 4
+#define PRIVATE_LIMIT 2
+#define CREDIT_ID 5
+
+int main(int argc, char *argv[])
+{
+  const msg_client_config_t clients[] = {
+    {PRIVATE_ID, PRIVATE_LIMIT, MSG_POLICY_FAIL, PRIVATE_POOL},
+    {4, 0, MSG_POLICY_BLOCK, 0},
+    {CREDIT_ID, 1, MSG_POLICY_FAIL, 0}
+  };
+  const msg_client_config_t twice[] = {
+    {4, 0, MSG_POLICY_BLOCK, 0},
+    {4, 0, MSG_POLICY_BLOCK, 0}
+  };
+  msg_config_t config = {
+    .pool_size = POOL_SIZE,
+    .msg_size = MSG_SIZE,
+    .pretouch = TRUE,
+    .clientsp = twice,
+    .numclients = 2
+  };
+  message_t *msg[POOL_SIZE];
+  message_t *privp[PRIVATE_POOL];
+  message_t *chainp = NULL;
+  message_t *restp = NULL;
+  mempool_stat_t stat;
+  client_stat_t cstat;
+  uint8_t buf[200];
+
+  printf("Testing message_service_init");
+  assert(-1 == message_service_init(&config));
+  config.clientsp = clients;
+  config.numclients = 3;
+  config.msg_size = MSG_DATA_MAX + 1;
+  assert(-1 == message_service_init(&config));
+  config.msg_size = MSG_SIZE;
+
+  /* CREDIT_ID cannot shrink below its reserved slots; the pools created
+  * before it fails are freed and init can be called again.
+  */
+  assert(0 == client_set_notify(CREDIT_ID, NULL, NULL));
+  assert(2 == credit_acquire(CREDIT_ID, 2));
+  assert(-1 == message_service_init(&config));
+  assert(0 == message_get_pool_stat(&stat));
+  assert(0 == stat.numblk);
+  assert(0 == credit_release(CREDIT_ID, 2));
+  assert(0 == message_service_init(&config));
+  assert(-1 == message_service_init(&config));
+  assert(-1 == message_service_init(NULL));
+  printf("... PASSED\n");
+
+  printf("Testing pool size and message size");
+  assert(MSG_SIZE == message_data_max());
+  for (uint32_t i = 0; i < POOL_SIZE; i++)
+  {
+    msg[i] = new_message();
+    assert(msg[i]);
+  }
+  assert(NULL == new_message());
+
+  /* Blocks still hold a whole message_t; copying one never reaches the
+  * next block.
+  */
+  for (uint32_t i = 0; i < POOL_SIZE; i++)
+  {
+    memset(msg[i], 0xA5, sizeof(message_t));
+    msg[i]->len = (uint8_t) i;
+  }
+  for (uint32_t i = 0; i < POOL_SIZE; i++)
+  {
+    assert(i == msg[i]->len && NULL == chain_next(msg[i]));
+    delete_message(msg[i]);
+  }
+
+  memset(buf, 0xA5, sizeof(buf));
+  assert(0 == chain_append(&chainp, buf, sizeof(buf)));
+  assert(sizeof(buf) == chain_len(chainp));
+  assert(MSG_SIZE == chainp->len);
+  assert(0 == message_get_pool_stat(&stat));
+  assert((sizeof(buf) + MSG_SIZE - 1) / MSG_SIZE == stat.live);
+  delete_message(chainp);
+  printf("... PASSED\n");
+
+  /* A block filled past MSG_SIZE through msg->len keeps its payload;
+  * appended bytes start a new block.
+  */
+  printf("Testing chain_append after a block filled to MSG_DATA_MAX");
+  chainp = new_message();
+  assert(chainp);
+  memset(chainp->data, 0x5A, MSG_DATA_MAX);
+  chainp->len = MSG_DATA_MAX;
+  assert(0 == chain_append(&chainp, buf, MSG_SIZE / 2));
+  assert(MSG_DATA_MAX == chainp->len);
+  assert(MSG_DATA_MAX + MSG_SIZE / 2 == chain_len(chainp));
+  assert(chain_next(chainp) && MSG_SIZE / 2 == chain_next(chainp)->len);
+  assert(NULL == chain_next(chain_next(chainp)));
+  assert(0 == memcmp(chain_next(chainp)->data, buf, MSG_SIZE / 2));
+  for (uint32_t i = 0; i < MSG_DATA_MAX; i++)
+  {
+    assert(0x5A == chainp->data[i]);
+  }
+  delete_message(chainp);
+  assert(0 == message_get_pool_stat(&stat));
+  assert(0 == stat.live);
+  printf("... PASSED\n");
+
+  printf("Testing private client pool");
+  for (uint32_t i = 0; i < PRIVATE_POOL; i++)
+  {
+    privp[i] = client_new_message(PRIVATE_ID);
+    assert(privp[i]);
+    privp[i]->len = 0;
+  }
+  assert(NULL == client_new_message(PRIVATE_ID));
+
+  /* Chains grow from the pool of their last block */
+  chainp = privp[PRIVATE_POOL - 1];
+  assert(-1 == chain_append(&chainp, buf, MSG_SIZE + 1));
+  assert(0 == message_get_pool_stat(&stat));
+  assert(0 == stat.live);
+
+  /* Client 4 has no private pool */
+  msg[0] = client_new_message(4);
+  assert(0 == message_get_pool_stat(&stat));
+  assert(1 == stat.live);
+  delete_message(msg[0]);
+  printf("... PASSED\n");
+
+  printf("Testing configured clients before their receiver starts");
+  assert(0 == send(PRIVATE_ID, privp[0]));
+  assert(0 == send(PRIVATE_ID, privp[1]));
+  assert(MSG_FULL == send(PRIVATE_ID, privp[2]));
+  assert(0 == client_get_stat(PRIVATE_ID, &cstat));
+  assert(PRIVATE_LIMIT == cstat.limit);
+  assert(2 == cstat.depth);
+  assert(0 == client_get_stat(4, &cstat));
+  assert(MSG_QUEUE_DEFAULT_LIMIT == cstat.limit);
+  assert(0 == client_get_stat(CREDIT_ID, &cstat));
+  assert(1 == cstat.limit);
+
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    assert(0 == try_recv(PRIVATE_ID, &msg[i]));
+    delete_message(msg[i]);
+  }
+  delete_message(privp[2]);
+  delete_message(privp[3]);
+  for (uint32_t i = 0; i < PRIVATE_POOL; i++)
+  {
+    privp[i] = client_new_message(PRIVATE_ID);
+    assert(privp[i]);
+  }
+  for (uint32_t i = 0; i < PRIVATE_POOL; i++)
+  {
+    delete_message(privp[i]);
+  }
+  printf("... PASSED\n");
+
+  /* The block holding the end of a split private block is private too */
+  printf("Testing chain_split of a private block");
+  chainp = client_new_message(PRIVATE_ID);
+  assert(chainp);
+  chainp->len = 0;
+  assert(0 == chain_append(&chainp, buf, MSG_SIZE));
+  assert(NULL == chain_next(chainp));
+  restp = chain_split(chainp, MSG_SIZE / 2);
+  assert(restp && MSG_SIZE / 2 == chain_len(restp));
+  assert(0 == memcmp(restp->data, buf + MSG_SIZE / 2, MSG_SIZE / 2));
+  assert(0 == message_get_pool_stat(&stat));
+  assert(0 == stat.live);
+  for (uint32_t i = 0; i < PRIVATE_POOL - 2; i++)
+  {
+    privp[i] = client_new_message(PRIVATE_ID);
+    assert(privp[i]);
+  }
+  assert(NULL == client_new_message(PRIVATE_ID));
+  for (uint32_t i = 0; i < PRIVATE_POOL - 2; i++)
+  {
+    delete_message(privp[i]);
+  }
+  delete_message(chainp);
+  delete_message(restp);
+  printf("... PASSED\n");
+
+  return 0;
+}
@@ -4,11 +4,31 @@
 #include <signal.h>
 #include <unistd.h>
 #include <string.h>
+#include <assert.h>
 
 #include "message.h"
+#include "trace.h"
 
 #define NUM_TIDS 5
 
+/* Clients of the unit tests, above the IDs of the demo threads */
+#define MAILBOX_ID 10
+#define LANES_ID 11
+#define SERVER_ID 12
+#define DROP_ID 13
+
+/* Requests understood by server_fcn */
+#define REQ_REPLY 'R'
+#define REQ_LATE 'L'
+#define REQ_HOLD 'H'
+#define REQ_FREE 'F'
+#define REQ_QUIT 'Q'
+#define LATE_MS 100
+
+static uint32_t held_count = 0;
+static int late_res = 0;
+static boolean late_done = FALSE;
+
 
 
 /*
@@ -78,12 +98,488 @@ void * thread_fcn(void *arg)
 }
 
 
+/*
+* NAME :        tagged_message
+*
+* DESCRIPTION : Creates a message carrying one byte
+*
+* INPUTS :      tag - byte to carry
+*
+* OUTPUTS :     New message
+*
+*/
+static message_t * tagged_message(uint8_t tag)
+{
+  message_t *msg = new_message();
+
+  assert(msg);
+  msg->data[0] = tag;
+  msg->len = 1;
+
+  return msg;
+}
+
+/*
+* NAME :        recv_tag
+*
+* DESCRIPTION : Takes a message without waiting and deletes it
+*
+* INPUTS :      client_id - ID of client
+*
+* OUTPUTS :     Tag of the message
+*
+*/
+static uint8_t recv_tag(uint8_t client_id)
+{
+  message_t *msg = NULL;
+  uint8_t tag = 0;
+
+  assert(0 == try_recv(client_id, &msg));
+  tag = msg->data[0];
+  delete_message(msg);
+
+  return tag;
+}
+
+/*
+* NAME :        blocked_send_fcn
+*
+* DESCRIPTION : Sends one message to the mailbox test client
+*
+* INPUTS :      arg - message
+*
+* OUTPUTS :     None
+*
+*/
+static void * blocked_send_fcn(void *arg)
+{
+  assert(0 == send(MAILBOX_ID, (message_t *) arg));
+
+  return NULL;
+}
+
+/*
+* NAME :        test_mailbox
+*
+* DESCRIPTION : Checks the full-mailbox policies, the mailbox counters and
+*               credits
+*
+* INPUTS :      None
+*
+* OUTPUTS :     None
+*
+*/
+static void test_mailbox(void)
+{
+  client_stat_t stat;
+  message_t *msg = NULL;
+  pthread_t tid;
+
+  printf("Testing MSG_POLICY_FAIL");
+  assert(0 == client_set_limit(MAILBOX_ID, 2, MSG_POLICY_FAIL));
+  assert(0 == client_set_notify(MAILBOX_ID, NULL, NULL));
+  assert(0 == send(MAILBOX_ID, tagged_message(1)));
+  assert(0 == send(MAILBOX_ID, tagged_message(2)));
+  msg = tagged_message(3);
+  assert(MSG_FULL == send(MAILBOX_ID, msg));
+  assert(0 == client_get_stat(MAILBOX_ID, &stat));
+  assert(2 == stat.depth && 2 == stat.hwm && 0 == stat.drops && 0 == stat.credits);
+  printf("... PASSED\n");
+
+  printf("Testing MSG_POLICY_DROP_OLDEST");
+  assert(0 == client_set_limit(MAILBOX_ID, 2, MSG_POLICY_DROP_OLDEST));
+  assert(0 == send(MAILBOX_ID, msg));
+  assert(0 == client_get_stat(MAILBOX_ID, &stat));
+  assert(2 == stat.depth && 2 == stat.hwm && 1 == stat.drops);
+  assert(2 == recv_tag(MAILBOX_ID));
+  assert(3 == recv_tag(MAILBOX_ID));
+  assert(MSG_EMPTY == try_recv(MAILBOX_ID, &msg));
+  assert(0 == client_get_stat(MAILBOX_ID, &stat));
+  assert(0 == stat.depth && 2 == stat.hwm && 3 == stat.sends && 2 == stat.recvs);
+  printf("... PASSED\n");
+
+  /* The second sender waits until the first message is taken */
+  printf("Testing MSG_POLICY_BLOCK");
+  assert(0 == client_set_limit(MAILBOX_ID, 1, MSG_POLICY_BLOCK));
+  assert(0 == send(MAILBOX_ID, tagged_message(4)));
+  assert(0 == pthread_create(&tid, NULL, blocked_send_fcn, tagged_message(5)));
+  usleep(50 * 1000);
+  assert(0 == client_get_stat(MAILBOX_ID, &stat));
+  assert(1 == stat.depth && 4 == stat.sends);
+  assert(4 == recv_tag(MAILBOX_ID));
+  pthread_join(tid, NULL);
+  assert(5 == recv_tag(MAILBOX_ID));
+  printf("... PASSED\n");
+
+  printf("Testing credits");
+  assert(0 == client_set_limit(MAILBOX_ID, 4, MSG_POLICY_FAIL));
+  assert(4 == send_credits(MAILBOX_ID));
+  assert(3 == credit_acquire(MAILBOX_ID, 3));
+  assert(1 == send_credits(MAILBOX_ID));
+  assert(1 == credit_acquire(MAILBOX_ID, 2));
+  assert(0 == credit_release(MAILBOX_ID, 1));
+  assert(-1 == credit_release(MAILBOX_ID, 4));
+
+  /* Plain sends only get the slot nobody reserved */
+  assert(0 == send(MAILBOX_ID, tagged_message(6)));
+  msg = tagged_message(7);
+  assert(MSG_FULL == send(MAILBOX_ID, msg));
+  assert(-1 == client_set_limit(MAILBOX_ID, 3, MSG_POLICY_FAIL));
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    assert(0 == send_with_credit(MAILBOX_ID, tagged_message(8 + i)));
+  }
+  assert(-1 == send_with_credit(MAILBOX_ID, msg));
+  assert(0 == credit_acquire(MAILBOX_ID, 1));
+  assert(0 == client_get_stat(MAILBOX_ID, &stat));
+  assert(4 == stat.depth && 0 == stat.reserved && 0 == stat.credits);
+  assert(6 == recv_tag(MAILBOX_ID));
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    assert(8 + i == recv_tag(MAILBOX_ID));
+  }
+  delete_message(msg);
+  printf("... PASSED\n");
+}
+
+/*
+* NAME :        test_lanes
+*
+* DESCRIPTION : Checks the receive order of priority lanes and which message
+*               MSG_POLICY_DROP_OLDEST drops
+*
+* INPUTS :      None
+*
+* OUTPUTS :     None
+*
+*/
+static void test_lanes(void)
+{
+  const uint8_t prios[] = {MSG_PRIO_DEFAULT, 1, MSG_PRIO_HIGHEST, 2, 1};
+  const uint8_t order[] = {2, 1, 4, 3, 0};
+  client_stat_t stat;
+  message_t *msg = NULL;
+
+  printf("Testing priority lane order");
+  assert(0 == client_set_limit(LANES_ID, 8, MSG_POLICY_FAIL));
+  assert(0 == client_set_notify(LANES_ID, NULL, NULL));
+  msg = tagged_message(0);
+  assert(-1 == send_prio(LANES_ID, msg, MSG_NUM_PRIO));
+  delete_message(msg);
+  for (uint8_t i = 0; i < sizeof(prios); i++)
+  {
+    assert(0 == send_prio(LANES_ID, tagged_message(i), prios[i]));
+  }
+  for (uint8_t i = 0; i < sizeof(order); i++)
+  {
+    assert(order[i] == recv_tag(LANES_ID));
+  }
+  printf("... PASSED\n");
+
+  printf("Testing MSG_POLICY_DROP_OLDEST with priority lanes");
+  assert(0 == client_set_limit(LANES_ID, 2, MSG_POLICY_DROP_OLDEST));
+
+  /* The lowest priority lane loses its oldest message */
+  assert(0 == send_prio(LANES_ID, tagged_message(10), MSG_PRIO_HIGHEST));
+  assert(0 == send_prio(LANES_ID, tagged_message(11), MSG_PRIO_DEFAULT));
+  assert(0 == send_prio(LANES_ID, tagged_message(12), 1));
+  assert(0 == client_get_stat(LANES_ID, &stat));
+  assert(2 == stat.depth && 1 == stat.drops);
+
+  /* Only higher priority messages are queued, so the new one is dropped */
+  assert(0 == send(LANES_ID, tagged_message(13)));
+  assert(0 == client_get_stat(LANES_ID, &stat));
+  assert(2 == stat.depth && 2 == stat.drops);
+
+  /* Same lane, the oldest message goes */
+  assert(0 == send_prio(LANES_ID, tagged_message(14), 1));
+  assert(0 == client_get_stat(LANES_ID, &stat));
+  assert(2 == stat.depth && 3 == stat.drops);
+  assert(10 == recv_tag(LANES_ID));
+  assert(14 == recv_tag(LANES_ID));
+  printf("... PASSED\n");
+}
+
+/*
+* NAME :        server_fcn
+*
+* DESCRIPTION : Call server of the call/reply tests. Replies at once, replies
+*               late, holds requests or deletes the held requests without a
+*               reply, depending on the request tag.
+*
+* INPUTS :      arg - Not used
+*
+* OUTPUTS :     None
+*
+*/
+static void * server_fcn(void *arg)
+{
+  message_t **msg = NULL;
+  message_t *req = NULL;
+  message_t *resp = NULL;
+  message_t *held[MSG_MAX_CALLS];
+  uint32_t numheld = 0;
+  boolean running = TRUE;
+
+  while (running && 0 == recv(SERVER_ID, (message_t *) &msg))
+  {
+    req = *msg;
+    switch (req->data[0])
+    {
+      case REQ_REPLY:
+        assert(message_corrid(req));
+        assert(0 == reply(req, tagged_message(REQ_REPLY)));
+        assert(0 == message_corrid(req));
+        delete_message(req);
+        break;
+
+      case REQ_LATE:
+        usleep(LATE_MS * 1000);
+        resp = tagged_message(REQ_LATE);
+        late_res = reply(req, resp);
+        if (0 != late_res)
+        {
+          delete_message(resp);
+        }
+        delete_message(req);
+        __atomic_store_n(&late_done, TRUE, __ATOMIC_RELEASE);
+        break;
+
+      case REQ_HOLD:
+        held[numheld++] = req;
+        __atomic_store_n(&held_count, numheld, __ATOMIC_RELEASE);
+        break;
+
+      case REQ_FREE:
+        for (; numheld; numheld--)
+        {
+          delete_message(held[numheld - 1]);
+        }
+        delete_message(req);
+        break;
+
+      default:
+        delete_message(req);
+        running = FALSE;
+        break;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+* NAME :        failed_call_fcn
+*
+* DESCRIPTION : Calls a client and expects the request to be lost
+*
+* INPUTS :      arg - ID of destination client
+*
+* OUTPUTS :     None
+*
+*/
+static void * failed_call_fcn(void *arg)
+{
+  uint8_t dest = (uint8_t) (uintptr_t) arg;
+  message_t *rep = NULL;
+
+  assert(MSG_ERROR == call(dest, tagged_message(REQ_HOLD), &rep, -1));
+
+  return NULL;
+}
+
+/*
+* NAME :        test_call
+*
+* DESCRIPTION : Checks call/reply, timeouts, late replies, lost requests and
+*               the bound on calls in flight
+*
+* INPUTS :      None
+*
+* OUTPUTS :     None
+*
+*/
+static void test_call(void)
+{
+  pthread_t servertid;
+  pthread_t tid[MSG_MAX_CALLS];
+  mempool_stat_t stat;
+  client_stat_t cstat;
+  message_t *msg = NULL;
+  message_t *rep = NULL;
+
+  assert(0 == client_set_limit(SERVER_ID, 2 * MSG_MAX_CALLS, MSG_POLICY_BLOCK));
+  assert(0 == client_set_notify(SERVER_ID, NULL, NULL));
+  assert(0 == pthread_create(&servertid, NULL, server_fcn, NULL));
+
+  printf("Testing call and reply");
+  assert(0 == call(SERVER_ID, tagged_message(REQ_REPLY), &rep, -1));
+  assert(REQ_REPLY == rep->data[0]);
+  delete_message(rep);
+  assert(0 == call(SERVER_ID, tagged_message(REQ_REPLY), &rep, 1000));
+  delete_message(rep);
+  printf("... PASSED\n");
+
+  printf("Testing call timeout and late reply");
+  assert(MSG_TIMEOUT == call(SERVER_ID, tagged_message(REQ_LATE), &rep, LATE_MS / 4));
+  while (!__atomic_load_n(&late_done, __ATOMIC_ACQUIRE))
+  {
+    usleep(1000);
+  }
+  assert(-1 == late_res);
+  printf("... PASSED\n");
+
+  /* The server keeps every request, so all call records stay in use */
+  printf("Testing call record exhaustion and deleted requests");
+  for (uint32_t i = 0; i < MSG_MAX_CALLS; i++)
+  {
+    assert(0 == pthread_create(&tid[i], NULL, failed_call_fcn,
+                               (void *) (uintptr_t) SERVER_ID));
+  }
+  while (__atomic_load_n(&held_count, __ATOMIC_ACQUIRE) < MSG_MAX_CALLS)
+  {
+    usleep(1000);
+  }
+  msg = tagged_message(REQ_REPLY);
+  assert(-1 == call(SERVER_ID, msg, &rep, 10));
+  assert(0 == message_corrid(msg));
+  delete_message(msg);
+
+  /* Deleting the held requests fails their calls */
+  assert(0 == send(SERVER_ID, tagged_message(REQ_FREE)));
+  for (uint32_t i = 0; i < MSG_MAX_CALLS; i++)
+  {
+    pthread_join(tid[i], NULL);
+  }
+  assert(0 == call(SERVER_ID, tagged_message(REQ_REPLY), &rep, -1));
+  delete_message(rep);
+  printf("... PASSED\n");
+
+  printf("Testing dropped call request");
+  assert(0 == client_set_limit(DROP_ID, 1, MSG_POLICY_DROP_OLDEST));
+  assert(0 == client_set_notify(DROP_ID, NULL, NULL));
+  assert(0 == pthread_create(&tid[0], NULL, failed_call_fcn,
+                             (void *) (uintptr_t) DROP_ID));
+  do
+  {
+    usleep(1000);
+    assert(0 == client_get_stat(DROP_ID, &cstat));
+  } while (0 == cstat.depth);
+  assert(0 == send(DROP_ID, tagged_message(1)));
+  pthread_join(tid[0], NULL);
+  assert(1 == recv_tag(DROP_ID));
+  printf("... PASSED\n");
+
+  assert(0 == send(SERVER_ID, tagged_message(REQ_QUIT)));
+  pthread_join(servertid, NULL);
+  assert(0 == message_get_pool_stat(&stat));
+  assert(0 == stat.live);
+}
+
+/*
+* NAME :        test_chain
+*
+* DESCRIPTION : Checks chained messages: appends across blocks, iovec and
+*               flat copies, and splits
+*
+* INPUTS :      None
+*
+* OUTPUTS :     None
+*
+*/
+static void test_chain(void)
+{
+  const uint32_t total = 2 * MSG_DATA_MAX + 10;
+  const uint32_t mid = MSG_DATA_MAX + 45;
+  uint8_t buf[3 * MSG_DATA_MAX];
+  uint8_t out[3 * MSG_DATA_MAX];
+  struct iovec iov[4];
+  mempool_stat_t stat;
+  message_t *chainp = NULL;
+  message_t *restp = NULL;
+  message_t *tailp = NULL;
+
+  for (uint32_t i = 0; i < sizeof(buf); i++)
+  {
+    buf[i] = (uint8_t) (i * 7);
+  }
+
+  printf("Testing chain_append across a block boundary");
+  assert(-1 == chain_append(NULL, buf, 1));
+  assert(0 == chain_append(&chainp, buf, 100));
+  assert(NULL == chain_next(chainp));
+  assert(0 == chain_append(&chainp, buf + 100, total - 100));
+  assert(total == chain_len(chainp));
+  assert(MSG_DATA_MAX == chainp->len);
+  assert(MSG_DATA_MAX == chain_next(chainp)->len);
+  assert(10 == chain_next(chain_next(chainp))->len);
+  printf("... PASSED\n");
+
+  printf("Testing chain_iov");
+  assert(3 == chain_iov(chainp, iov, 4));
+  assert(chainp->data == iov[0].iov_base && MSG_DATA_MAX == iov[0].iov_len);
+  assert(10 == iov[2].iov_len);
+  assert(-1 == chain_iov(chainp, iov, 2));
+  assert(-1 == chain_iov(chainp, NULL, 4));
+  printf("... PASSED\n");
+
+  printf("Testing chain_copy");
+  assert(total == chain_copy(chainp, out, sizeof(out)));
+  assert(0 == memcmp(out, buf, total));
+  memset(out, 0, sizeof(out));
+  assert(mid == chain_copy(chainp, out, mid));
+  assert(0 == memcmp(out, buf, mid) && 0 == out[mid]);
+  assert(0 == chain_copy(chainp, out, 0));
+  printf("... PASSED\n");
+
+  printf("Testing chain_split");
+
+  /* At the end of the chain nothing is split off */
+  assert(NULL == chain_split(chainp, total));
+  assert(total == chain_len(chainp));
+
+  /* Inside a block, the end of that block is copied into a new block */
+  restp = chain_split(chainp, mid);
+  assert(mid == chain_len(chainp) && total - mid == chain_len(restp));
+  assert(total - mid == chain_copy(restp, out, sizeof(out)));
+  assert(0 == memcmp(out, buf + mid, total - mid));
+
+  /* At a block boundary, the following blocks are moved */
+  tailp = chain_split(chainp, MSG_DATA_MAX);
+  assert(MSG_DATA_MAX == chain_len(chainp) && NULL == chain_next(chainp));
+  assert(mid - MSG_DATA_MAX == chain_len(tailp));
+  delete_message(tailp);
+
+  /* At offset 0, the first block is kept empty */
+  tailp = chain_split(restp, 0);
+  assert(0 == chain_len(restp) && NULL == chain_next(restp));
+  assert(total - mid == chain_copy(tailp, out, sizeof(out)));
+  assert(0 == memcmp(out, buf + mid, total - mid));
+
+  delete_message(chainp);
+  delete_message(restp);
+  delete_message(tailp);
+  assert(0 == message_get_pool_stat(&stat));
+  assert(0 == stat.live);
+  printf("... PASSED\n");
+}
+
 int main(int argc, char *argv[])
 {
   pthread_t tid[NUM_TIDS];
   int args[NUM_TIDS];
+  client_stat_t cstat;
   message_t * msg;
 
+#ifdef MSG_TRACE
+  trace_enable(1);
+#endif
+
+  test_mailbox();
+  test_lanes();
+  test_call();
+  test_chain();
+
   /* Create multiple threads */
   for (int i = 0; i < NUM_TIDS; i++)
   {
@@ -91,22 +587,24 @@ int main(int argc, char *argv[])
     pthread_create(&tid[i], NULL, thread_fcn, &args[i]);
   }
 
-  /* Wait 2 seconds to just make sure all threads are initiated 
-  * Just for simplicity, I have used sleep. Otherwise this is probably
-  * the worst way for synchronizing threads.
-  * A mutex guarded counter could be used to let main function know about number
-  * of threads that are ready. Once counter == NUM_TIDS, then the process could
-  * start. Each thread would hold the mutex and increment the counter by 1.
+  /* Each thread registers its mailbox with its first recv; wait until all
+  * of them can be sent to.
   */
-  sleep(2);
+  for (int i = 0; i < NUM_TIDS; i++)
+  {
+    while (MSG_SUCCESS != client_get_stat(i, &cstat))
+    {
+      usleep(1000);
+    }
+  }
 
   /* Sending EXIT message */
   printf("%s - Sending EXIT message to threads.\n", __func__);
   msg = new_message();
-  strncpy((char *)(msg->data), "EXIT", 4);
+  strcpy((char *)(msg->data), "EXIT");
   msg->len = 4;
-  /* Send message to thread 1 */
-  send(0, msg);
+  /* Send message to thread 1. Control messages overtake queued traffic. */
+  send_prio(0, msg, MSG_PRIO_HIGHEST);
 
   /* Wait for all threads to join */
   for(int i = 0; i < NUM_TIDS; i++)
@@ -114,5 +612,13 @@ int main(int argc, char *argv[])
     pthread_join(tid[i], NULL);
   }
 
+  /* Report pool and client counters */
+  message_stat_dump(stdout);
+
+#ifdef MSG_TRACE
+  trace_enable(0);
+  trace_export("message-trace.json");
+#endif
+
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,675 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "message.h"
+#include "mempool/mempool.h"
+
+#define SUCCESS 0
+#define ERROR -1
+
+/* Wheel geometry: TIMER_LEVELS levels of TIMER_SLOTS slots, level n slots
+* are TIMER_SLOTS^n ticks wide.
+*/
+#define TIMER_TICK_MS 1
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4
+#define TIMER_RANGE (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS))
+
+#define MAX_NUM_TIMER 4096
+
+/* Timer IDs carry a generation so a stale ID never cancels a reused node */
+#define TIMER_ID(idx, gen) (((uint32_t) (gen) << 16) | ((idx) + 1))
+#define TIMER_ID_IDX(id) (((id) & 0xFFFF) - 1)
+#define TIMER_ID_GEN(id) ((id) >> 16)
+
+/*
+* NAME :        timer_s
+*
+* DESCRIPTION : Pending timer, linked in one wheel slot
+*
+* MEMBERS :     prevp - Previous timer in the slot
+*               nextp - Next timer in the slot
+*               slotp - Slot head the timer is linked to, NULL when unlinked
+*               expires - Tick the timer fires at
+*               period - Ticks between firings, 0 for a one-shot timer
+*               msg - Message sent, or copied for a periodic timer
+*               dest - Destination client
+*               prio - Mailbox lane the message is sent on
+*               gen - Generation, bumped when the timer leaves the wheel
+*
+* NOTES :      None
+*/
+struct timer_s
+{
+  struct timer_s *prevp;
+  struct timer_s *nextp;
+  struct timer_s **slotp;
+  uint64_t expires;
+  uint32_t period;
+  message_t *msg;
+  uint8_t dest;
+  uint8_t prio;
+  uint16_t gen;
+};
+
+static mempool_t _timer_pool = {0};
+static struct timer_s *wheel[TIMER_LEVELS][TIMER_SLOTS] = {{0}};
+
+/* Next tick to process and number of timers in the wheel */
+static uint64_t wheel_now = 0;
+static uint32_t wheel_count = 0;
+
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static boolean timer_inited = FALSE;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static pthread_t timer_tid;
+static boolean timer_running = FALSE;
+
+/*
+* NAME :        timer_ticks
+*
+* DESCRIPTION : Returns the monotonic clock in ticks
+*
+* INPUTS :      None
+*
+* OUTPUTS :     Current tick
+*
+* NOTES :       It is a static API
+*/
+static uint64_t timer_ticks(
+  void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return ((uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+/*
+* NAME :        timer_init
+*
+* DESCRIPTION : Creates the timer pool and the service thread condition
+*
+* INPUTS :      None
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API, run once through pthread_once.
+*/
+static void timer_init(
+  void)
+{
+  pthread_condattr_t attr;
+  struct timer_s *tp = NULL;
+
+  if (!mempool_init(&_timer_pool, MAX_NUM_TIMER, sizeof(struct timer_s)))
+  {
+    printf("%s - Error: Cannot initialize timer pool.\n", __func__);
+    return;
+  }
+
+  /* Cancel checks the generation of any block an ID points to */
+  for (uint32_t i = 0; i < MAX_NUM_TIMER; i++)
+  {
+    tp = (struct timer_s *) mempool_blk_addr(&_timer_pool, i);
+    tp->slotp = NULL;
+    tp->gen = 0;
+  }
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timer_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  timer_inited = TRUE;
+}
+
+/*
+* NAME :        wheel_insert
+*
+* DESCRIPTION : Links a timer in the slot matching its expiry
+*
+* INPUTS :      tp - timer
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API, called with timer_lock held. Timers
+*               beyond the wheel range wait in the last level and are
+*               placed again when that slot is cascaded.
+*/
+static void wheel_insert(
+  struct timer_s *tp)
+{
+  uint64_t expires = tp->expires;
+  uint64_t delta = 0;
+  uint32_t level = 0;
+
+  if (expires < wheel_now)
+  {
+    expires = wheel_now;
+  }
+  else if (expires - wheel_now >= TIMER_RANGE)
+  {
+    expires = wheel_now + TIMER_RANGE - 1;
+  }
+
+  delta = expires - wheel_now;
+  while (level < TIMER_LEVELS - 1 &&
+         delta >= (1ULL << (TIMER_SLOT_BITS * (level + 1))))
+  {
+    level++;
+  }
+
+  tp->slotp = &wheel[level][(expires >> (TIMER_SLOT_BITS * level)) &
+                            TIMER_SLOT_MASK];
+  tp->prevp = NULL;
+  tp->nextp = *tp->slotp;
+  if (tp->nextp)
+  {
+    tp->nextp->prevp = tp;
+  }
+  *tp->slotp = tp;
+}
+
+/*
+* NAME :        wheel_unlink
+*
+* DESCRIPTION : Removes a timer from its slot
+*
+* INPUTS :      tp - timer
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API, called with timer_lock held.
+*/
+static void wheel_unlink(
+  struct timer_s *tp)
+{
+  if (tp->prevp)
+  {
+    tp->prevp->nextp = tp->nextp;
+  }
+  else
+  {
+    *tp->slotp = tp->nextp;
+  }
+
+  if (tp->nextp)
+  {
+    tp->nextp->prevp = tp->prevp;
+  }
+  tp->prevp = NULL;
+  tp->nextp = NULL;
+  tp->slotp = NULL;
+}
+
+/*
+* NAME :        wheel_cascade
+*
+* DESCRIPTION : Moves the timers of an upper level slot to lower levels
+*
+* INPUTS :      level - wheel level
+*               idx - slot index
+*
+* OUTPUTS :     Slot index, 0 means the next level is due as well
+*
+* NOTES :       It is a static API, called with timer_lock held.
+*/
+static uint32_t wheel_cascade(
+  uint32_t level,
+  uint32_t idx)
+{
+  struct timer_s *tp = wheel[level][idx];
+  struct timer_s *nextp = NULL;
+
+  wheel[level][idx] = NULL;
+  for (; tp; tp = nextp)
+  {
+    nextp = tp->nextp;
+    wheel_insert(tp);
+  }
+
+  return idx;
+}
+
+/*
+* NAME :        timer_copy
+*
+* DESCRIPTION : Copies the message of a periodic timer
+*
+* INPUTS :      msg - message or chain
+*
+* OUTPUTS :     New message, NULL when the message pool is empty
+*
+* NOTES :       It is a static API
+*/
+static message_t * timer_copy(
+  message_t *msg)
+{
+  message_t *copyp = NULL;
+
+  for (; msg; msg = chain_next(msg))
+  {
+    if (SUCCESS != chain_append(&copyp, msg->data, msg->len))
+    {
+      delete_message(copyp);
+      return NULL;
+    }
+  }
+
+  return copyp;
+}
+
+/*
+* NAME :        wheel_advance
+*
+* DESCRIPTION : Processes ticks up to now and collects the expired timers
+*
+* INPUTS :      now - current tick
+*
+* OUTPUTS :     List of one-shot timers to send, linked by nextp
+*
+* NOTES :       It is a static API, called with timer_lock held. Periodic
+*               timers are put back in the wheel; each firing is carried
+*               by a one-shot timer holding a copy of the message.
+*/
+static struct timer_s * wheel_advance(
+  uint64_t now)
+{
+  struct timer_s *firedp = NULL;
+  struct timer_s *tp = NULL;
+  struct timer_s *shotp = NULL;
+  uint32_t idx = 0;
+
+  while (wheel_count && wheel_now <= now)
+  {
+    idx = wheel_now & TIMER_SLOT_MASK;
+    for (uint32_t level = 1; 0 == idx && level < TIMER_LEVELS; level++)
+    {
+      idx = wheel_cascade(level, (wheel_now >> (TIMER_SLOT_BITS * level)) &
+                                 TIMER_SLOT_MASK);
+    }
+
+    while ((tp = wheel[0][wheel_now & TIMER_SLOT_MASK]) != NULL)
+    {
+      wheel_unlink(tp);
+      if (0 == tp->period)
+      {
+        wheel_count--;
+        tp->gen++;
+        tp->nextp = firedp;
+        firedp = tp;
+        continue;
+      }
+
+      shotp = (struct timer_s *) mempool_alloc(&_timer_pool);
+      if (shotp)
+      {
+        shotp->msg = timer_copy(tp->msg);
+        shotp->dest = tp->dest;
+        shotp->prio = tp->prio;
+        shotp->nextp = firedp;
+        firedp = shotp;
+      }
+      if (!shotp || !shotp->msg)
+      {
+        printf("%s - Error: Periodic message to %u skipped.\n", __func__, tp->dest);
+      }
+
+      /* Firings missed while the thread was late are skipped */
+      tp->expires += tp->period;
+      if (tp->expires <= wheel_now)
+      {
+        tp->expires = wheel_now + tp->period;
+      }
+      wheel_insert(tp);
+    }
+    wheel_now++;
+  }
+
+  if (!wheel_count)
+  {
+    wheel_now = now + 1;
+  }
+
+  return firedp;
+}
+
+/*
+* NAME :        wheel_next_wake
+*
+* DESCRIPTION : Finds the tick the service thread has to wake up at
+*
+* INPUTS :      None
+*
+* OUTPUTS :     Tick of the next non-empty level 0 slot, or of the next
+*               cascade when the rest of level 0 is empty
+*
+* NOTES :       It is a static API, called with timer_lock held.
+*/
+static uint64_t wheel_next_wake(
+  void)
+{
+  uint64_t tick = wheel_now;
+
+  do
+  {
+    if (wheel[0][tick & TIMER_SLOT_MASK])
+    {
+      break;
+    }
+    tick++;
+  } while (tick & TIMER_SLOT_MASK);
+
+  return tick;
+}
+
+/*
+* NAME :        timer_thread_fcn
+*
+* DESCRIPTION : Service thread. Sleeps until the next due slot, advances the
+*               wheel and sends the expired messages.
+*
+* INPUTS :      arg - Not used
+*
+* OUTPUTS :     None
+*
+* NOTES :       It is a static API. Messages are sent without timer_lock,
+*               so a receiver may schedule timers from its handler. A full
+*               mailbox with MSG_POLICY_BLOCK delays the other timers.
+*/
+static void * timer_thread_fcn(
+  void *arg)
+{
+  struct timer_s *firedp = NULL;
+  struct timer_s *tp = NULL;
+  struct timespec deadline;
+  uint64_t wake = 0;
+
+  pthread_mutex_lock(&timer_lock);
+  while (timer_running)
+  {
+    if (0 == wheel_count)
+    {
+      pthread_cond_wait(&timer_cond, &timer_lock);
+      continue;
+    }
+
+    wake = wheel_next_wake() * TIMER_TICK_MS;
+    if (wake > timer_ticks() * TIMER_TICK_MS)
+    {
+      deadline.tv_sec = wake / 1000;
+      deadline.tv_nsec = (wake % 1000) * 1000000;
+      pthread_cond_timedwait(&timer_cond, &timer_lock, &deadline);
+      continue;
+    }
+
+    firedp = wheel_advance(timer_ticks());
+    if (!firedp)
+    {
+      continue;
+    }
+
+    pthread_mutex_unlock(&timer_lock);
+    for (tp = firedp; tp; tp = tp->nextp)
+    {
+      if (tp->msg && SUCCESS != send_prio(tp->dest, tp->msg, tp->prio))
+      {
+        delete_message(tp->msg);
+      }
+    }
+    pthread_mutex_lock(&timer_lock);
+
+    while (firedp)
+    {
+      tp = firedp;
+      firedp = tp->nextp;
+      mempool_rel(&_timer_pool, tp);
+    }
+  }
+  pthread_mutex_unlock(&timer_lock);
+
+  return NULL;
+}
+
+/*
+* NAME :        timer_add
+*
+* DESCRIPTION : Puts a timer in the wheel and starts the service thread
+*
+* INPUTS :      destination_id - ID of destination client
+*               msg - message to send
+*               prio - Mailbox lane
+*               delay_ms - time to the first firing
+*               period_ms - time between firings, 0 for a one-shot timer
+*               timeridp - set to the timer ID, may be NULL
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       It is a static API
+*/
+static int timer_add(
+  uint8_t destination_id,
+  message_t *msg,
+  uint8_t prio,
+  uint32_t delay_ms,
+  uint32_t period_ms,
+  uint32_t *timeridp)
+{
+  struct timer_s *tp = NULL;
+  uint64_t now = 0;
+
+  pthread_once(&timer_once, timer_init);
+  if (!timer_inited)
+  {
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&timer_lock);
+  tp = (struct timer_s *) mempool_alloc(&_timer_pool);
+  if (!tp)
+  {
+    pthread_mutex_unlock(&timer_lock);
+    printf("%s - Error: No timer available.\n", __func__);
+    return ERROR;
+  }
+
+  if (!timer_running)
+  {
+    timer_running = TRUE;
+    if (pthread_create(&timer_tid, NULL, timer_thread_fcn, NULL) != SUCCESS)
+    {
+      timer_running = FALSE;
+      mempool_rel(&_timer_pool, tp);
+      pthread_mutex_unlock(&timer_lock);
+      printf("%s - Error: Cannot create timer thread.\n", __func__);
+      return ERROR;
+    }
+  }
+
+  /* Round up so a timer never fires early */
+  now = timer_ticks();
+  if (0 == wheel_count)
+  {
+    wheel_now = now;
+  }
+  tp->expires = now + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS + 1;
+  tp->period = (period_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  tp->msg = msg;
+  tp->dest = destination_id;
+  tp->prio = prio;
+  wheel_insert(tp);
+  wheel_count++;
+  if (timeridp)
+  {
+    *timeridp = TIMER_ID(mempool_blk_index(&_timer_pool, tp), tp->gen);
+  }
+
+  /* The thread sleeps until its next slot; let it see the new one */
+  pthread_cond_signal(&timer_cond);
+  pthread_mutex_unlock(&timer_lock);
+
+  return SUCCESS;
+}
+
+/*
+* NAME :        send_after
+*
+* DESCRIPTION : Sends a message to client by ID after a delay
+*
+* INPUTS :      destination_id - ID of destination client
+*               msg - message to send
+*               prio - Mailbox lane, MSG_PRIO_HIGHEST is received first
+*               delay_ms - delay in milliseconds
+*               timeridp - set to an ID for timer_cancel, may be NULL
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       The message stays in its pool block until it is sent with
+*               send_prio. If the send fails, the message is deleted.
+*/
+int send_after(
+  uint8_t destination_id,
+  message_t *msg,
+  uint8_t prio,
+  uint32_t delay_ms,
+  uint32_t *timeridp)
+{
+  if (!msg || prio >= MSG_NUM_PRIO)
+  {
+    printf("%s - Error: Invalid input parameters.\n", __func__);
+    return ERROR;
+  }
+
+  return timer_add(destination_id, msg, prio, delay_ms, 0, timeridp);
+}
+
+/*
+* NAME :        send_every
+*
+* DESCRIPTION : Sends a copy of a message to client by ID periodically
+*
+* INPUTS :      destination_id - ID of destination client
+*               msg - message to copy
+*               prio - Mailbox lane, MSG_PRIO_HIGHEST is received first
+*               period_ms - period in milliseconds, first copy after one period
+*               timeridp - set to an ID for timer_cancel, may be NULL
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       The timer owns msg until it is cancelled. A firing is skipped
+*               when the message pool has no block for the copy.
+*/
+int send_every(
+  uint8_t destination_id,
+  message_t *msg,
+  uint8_t prio,
+  uint32_t period_ms,
+  uint32_t *timeridp)
+{
+  if (!msg || prio >= MSG_NUM_PRIO || 0 == period_ms)
+  {
+    printf("%s - Error: Invalid input parameters.\n", __func__);
+    return ERROR;
+  }
+
+  return timer_add(destination_id, msg, prio, period_ms, period_ms, timeridp);
+}
+
+/*
+* NAME :        timer_cancel
+*
+* DESCRIPTION : Cancels a pending timer and deletes its message
+*
+* INPUTS :      timerid - ID from send_after or send_every
+*
+* OUTPUTS :     ERROR - timer unknown or already fired
+*               SUCCESS - Successful
+*
+* NOTES :       None
+*/
+int timer_cancel(
+  uint32_t timerid)
+{
+  struct timer_s *tp = NULL;
+
+  if (!timer_inited || 0 == timerid)
+  {
+    return ERROR;
+  }
+
+  pthread_mutex_lock(&timer_lock);
+  tp = (struct timer_s *) mempool_blk_addr(&_timer_pool, TIMER_ID_IDX(timerid));
+  if (!tp || tp->gen != (uint16_t) TIMER_ID_GEN(timerid) || !tp->slotp)
+  {
+    pthread_mutex_unlock(&timer_lock);
+    return ERROR;
+  }
+
+  wheel_unlink(tp);
+  wheel_count--;
+  tp->gen++;
+  delete_message(tp->msg);
+  mempool_rel(&_timer_pool, tp);
+  pthread_mutex_unlock(&timer_lock);
+
+  return SUCCESS;
+}
+
+/*
+* NAME :        timer_stop
+*
+* DESCRIPTION : Stops the timer service thread and cancels all timers
+*
+* INPUTS :      None
+*
+* OUTPUTS :     None
+*
+* NOTES :       Scheduling a timer afterwards starts the thread again.
+*/
+void timer_stop(
+  void)
+{
+  struct timer_s *tp = NULL;
+
+  if (!timer_inited)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&timer_lock);
+  if (!timer_running)
+  {
+    pthread_mutex_unlock(&timer_lock);
+    return;
+  }
+  timer_running = FALSE;
+  pthread_cond_signal(&timer_cond);
+  pthread_mutex_unlock(&timer_lock);
+  pthread_join(timer_tid, NULL);
+
+  pthread_mutex_lock(&timer_lock);
+  for (uint32_t level = 0; level < TIMER_LEVELS; level++)
+  {
+    for (uint32_t idx = 0; idx < TIMER_SLOTS; idx++)
+    {
+      while ((tp = wheel[level][idx]) != NULL)
+      {
+        wheel_unlink(tp);
+        tp->gen++;
+        delete_message(tp->msg);
+        mempool_rel(&_timer_pool, tp);
+      }
+    }
+  }
+  wheel_count = 0;
+  pthread_mutex_unlock(&timer_lock);
+}
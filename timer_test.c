@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "message.h"
+
+#define CLIENT_ID 1
+#define PERIOD_MS 20
+#define LONG_MS 4200
+
+/*
+* NAME :        now_ms
+*
+* DESCRIPTION : Returns the monotonic clock in milliseconds
+*
+* INPUTS :      None
+*
+* OUTPUTS :     Milliseconds
+*
+*/
+static uint64_t now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+* NAME :        tagged_message
+*
+* DESCRIPTION : Creates a message carrying one byte
+*
+* INPUTS :      tag - byte to carry
+*
+* OUTPUTS :     New message
+*
+*/
+static message_t * tagged_message(uint8_t tag)
+{
+  message_t *msg = new_message();
+
+  assert(msg);
+  msg->data[0] = tag;
+  msg->len = 1;
+
+  return msg;
+}
+
+/*
+* NAME :        wait_message
+*
+* DESCRIPTION : Polls the test client until a message arrives
+*
+* INPUTS :      None
+*
+* OUTPUTS :     Tag of the message
+*
+*/
+static uint8_t wait_message(void)
+{
+  message_t *msg = NULL;
+  uint8_t tag = 0;
+
+  while (MSG_EMPTY == try_recv(CLIENT_ID, &msg))
+  {
+    usleep(1000);
+  }
+  tag = msg->data[0];
+  delete_message(msg);
+
+  return tag;
+}
+
+int main(int argc, char *argv[])
+{
+  const uint32_t delays[] = {150, 10, 80, 40, 5000};
+  mempool_stat_t stat;
+  message_t *msg = NULL;
+  uint32_t timerid = 0;
+  uint64_t start = 0;
+  uint64_t elapsed = 0;
+  uint32_t count = 0;
+
+  assert(0 == client_set_notify(CLIENT_ID, NULL, NULL));
+  assert(0 == client_set_limit(CLIENT_ID, 32, MSG_POLICY_FAIL));
+
+  printf("Testing invalid timers");
+  assert(-1 == send_after(CLIENT_ID, NULL, MSG_PRIO_DEFAULT, 10, NULL));
+  msg = tagged_message(0);
+  assert(-1 == send_after(CLIENT_ID, msg, MSG_NUM_PRIO, 10, NULL));
+  assert(-1 == send_every(CLIENT_ID, msg, MSG_PRIO_DEFAULT, 0, NULL));
+  assert(-1 == send_every(CLIENT_ID, msg, MSG_NUM_PRIO, PERIOD_MS, NULL));
+  delete_message(msg);
+  assert(-1 == timer_cancel(0));
+  printf("... PASSED\n");
+
+  /* Delays span the first two wheel levels */
+  printf("Testing send_after order and delay");
+  start = now_ms();
+  for (uint32_t i = 0; i < 4; i++)
+  {
+    assert(0 == send_after(CLIENT_ID, tagged_message(delays[i]), MSG_PRIO_DEFAULT,
+                            delays[i], NULL));
+  }
+  assert(10 == wait_message());
+  assert(now_ms() - start >= 10);
+  assert(40 == wait_message());
+  assert(80 == wait_message());
+  assert(150 == wait_message());
+  assert(now_ms() - start >= 150);
+  printf("... PASSED\n");
+
+  /* Timers firing together are received by lane */
+  printf("Testing send_after lanes");
+  assert(0 == send_after(CLIENT_ID, tagged_message(4), MSG_PRIO_DEFAULT, 20, NULL));
+  assert(0 == send_after(CLIENT_ID, tagged_message(5), MSG_PRIO_HIGHEST, 20, NULL));
+  usleep(100 * 1000);
+  assert(5 == wait_message());
+  assert(4 == wait_message());
+  printf("... PASSED\n");
+
+  /* Level 2 slots are 4096 ticks wide; the timer cascades down twice */
+  printf("Testing send_after cascade");
+  start = now_ms();
+  assert(0 == send_after(CLIENT_ID, tagged_message(6), MSG_PRIO_DEFAULT, LONG_MS, NULL));
+  assert(6 == wait_message());
+  elapsed = now_ms() - start;
+  assert(elapsed >= LONG_MS && elapsed < LONG_MS + 200);
+  printf("... PASSED\n");
+
+  printf("Testing timer_cancel");
+  assert(0 == send_after(CLIENT_ID, tagged_message(1), MSG_PRIO_DEFAULT, 30, &timerid));
+  assert(0 == timer_cancel(timerid));
+  assert(-1 == timer_cancel(timerid));
+  usleep(60 * 1000);
+  assert(MSG_EMPTY == try_recv(CLIENT_ID, &msg));
+  printf("... PASSED\n");
+
+  printf("Testing send_every");
+  assert(0 == send_every(CLIENT_ID, tagged_message(2), MSG_PRIO_DEFAULT, PERIOD_MS, &timerid));
+  start = now_ms();
+  while (count < 5)
+  {
+    assert(2 == wait_message());
+    count++;
+  }
+  assert(now_ms() - start >= 5 * PERIOD_MS - 1);
+  assert(0 == timer_cancel(timerid));
+  usleep(2 * PERIOD_MS * 1000);
+  while (0 == try_recv(CLIENT_ID, &msg))
+  {
+    delete_message(msg);
+  }
+  usleep(2 * PERIOD_MS * 1000);
+  assert(MSG_EMPTY == try_recv(CLIENT_ID, &msg));
+  printf("... PASSED\n");
+
+  printf("Testing timer_stop");
+  assert(0 == send_after(CLIENT_ID, tagged_message(3), MSG_PRIO_DEFAULT, delays[4], &timerid));
+  timer_stop();
+  assert(-1 == timer_cancel(timerid));
+  assert(0 == message_get_pool_stat(&stat));
+  assert(0 == stat.live);
+  printf("... PASSED\n");
+
+  return 0;
+}
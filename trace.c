@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define SUCCESS 0
+#define ERROR -1
+
+/*
+* NAME :        trace_event_s
+*
+* DESCRIPTION : One traced event
+*
+* MEMBERS :     ts_ns - Monotonic timestamp in nanoseconds
+*               block - Pool block index, -1 when unknown
+*               client_id - Client ID or TRACE_NO_CLIENT
+*               type - Event type
+*
+* NOTES :      None
+*/
+struct trace_event_s
+{
+  uint64_t ts_ns;
+  int32_t block;
+  uint16_t client_id;
+  uint8_t type;
+};
+
+/*
+* NAME :        trace_ring_s
+*
+* DESCRIPTION : Event ring of one thread
+*
+* MEMBERS :     head - Number of events ever recorded, published with release
+*               tid - Kernel thread ID
+*               nextp - Next ring in the list of all rings
+*               ev[] - Events, oldest ones are overwritten
+*
+* NOTES :      Only the owner thread writes a ring, so recording needs no lock.
+*              Rings are never freed so they can be exported after their
+*              thread exits.
+*/
+struct trace_ring_s
+{
+  uint64_t head;
+  uint32_t tid;
+  struct trace_ring_s *nextp;
+  struct trace_event_s ev[TRACE_RING_SIZE];
+};
+
+volatile int trace_enabled = 0;
+
+/* List of all rings, new rings are pushed at the head */
+static struct trace_ring_s *ringsp = NULL;
+
+/* Ring of the calling thread */
+static __thread struct trace_ring_s *ring_self = NULL;
+
+static const char *trace_names[] = {"alloc", "send", "wake", "recv", "free"};
+
+/*
+* NAME :        trace_ring_get
+*
+* DESCRIPTION : Returns the ring of the calling thread, creating it on first use
+*
+* INPUTS :      None
+*
+* OUTPUTS :     Ring or NULL if it cannot be allocated
+*
+* NOTES :       It is a static API
+*/
+static struct trace_ring_s * trace_ring_get(
+  void)
+{
+  struct trace_ring_s *ringp = ring_self;
+
+  if (ringp)
+  {
+    return ringp;
+  }
+
+  ringp = (struct trace_ring_s *) calloc(1, sizeof(struct trace_ring_s));
+  if (!ringp)
+  {
+    return NULL;
+  }
+
+  ringp->tid = (uint32_t) syscall(SYS_gettid);
+  ringp->nextp = __atomic_load_n(&ringsp, __ATOMIC_ACQUIRE);
+  while (!__atomic_compare_exchange_n(&ringsp, &ringp->nextp, ringp, 0,
+                                      __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+  ring_self = ringp;
+  return ringp;
+}
+
+/*
+* NAME :        trace_record
+*
+* DESCRIPTION : Records an event in the calling thread's ring
+*
+* INPUTS :      type - Event type
+*               client_id - Client ID or TRACE_NO_CLIENT
+*               block - Pool block index, -1 when unknown
+*
+* OUTPUTS :     None
+*
+* NOTES :       Use TRACE_EVENT instead of calling this directly.
+*/
+void trace_record(
+  trace_type_t type,
+  uint16_t client_id,
+  int32_t block)
+{
+  struct trace_ring_s *ringp = trace_ring_get();
+  struct trace_event_s *evp = NULL;
+  struct timespec now;
+
+  if (!ringp)
+  {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  evp = &ringp->ev[ringp->head & (TRACE_RING_SIZE - 1)];
+  evp->ts_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+  evp->block = block;
+  evp->client_id = client_id;
+  evp->type = (uint8_t) type;
+
+  __atomic_store_n(&ringp->head, ringp->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+* NAME :        trace_enable
+*
+* DESCRIPTION : Turns event recording on or off at runtime
+*
+* INPUTS :      enable - Non zero to record events
+*
+* OUTPUTS :     None
+*
+* NOTES :       None
+*/
+void trace_enable(
+  int enable)
+{
+  trace_enabled = enable;
+}
+
+/*
+* NAME :        trace_export
+*
+* DESCRIPTION : Writes recorded events in Chrome trace event format, which
+*               can be opened by chrome://tracing and Perfetto
+*
+* INPUTS :      path - Output file
+*
+* OUTPUTS :     ERROR - failure
+*               SUCCESS - Successful
+*
+* NOTES :       Events recorded while exporting may be torn; disable tracing
+*               first for an exact snapshot.
+*/
+int trace_export(
+  const char *path)
+{
+  struct trace_ring_s *ringp = NULL;
+  struct trace_event_s *evp = NULL;
+  uint64_t head = 0;
+  uint64_t first = 0;
+  const char *sep = "";
+  FILE *fp = NULL;
+
+  fp = fopen(path, "w");
+  if (!fp)
+  {
+    printf("%s - Error: Cannot open %s.\n", __func__, path);
+    return ERROR;
+  }
+
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (ringp = __atomic_load_n(&ringsp, __ATOMIC_ACQUIRE); ringp; ringp = ringp->nextp)
+  {
+    head = __atomic_load_n(&ringp->head, __ATOMIC_ACQUIRE);
+    first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    for (uint64_t i = first; i < head; i++)
+    {
+      evp = &ringp->ev[i & (TRACE_RING_SIZE - 1)];
+      fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%u,"
+              "\"ts\":%.3f,\"args\":{",
+              sep, trace_names[evp->type], (int) getpid(), ringp->tid,
+              evp->ts_ns / 1000.0);
+      if (evp->client_id != TRACE_NO_CLIENT)
+      {
+        fprintf(fp, "\"client\":%u%s", evp->client_id, evp->block >= 0 ? "," : "");
+      }
+      if (evp->block >= 0)
+      {
+        fprintf(fp, "\"block\":%d", evp->block);
+      }
+      fprintf(fp, "}}");
+      sep = ",\n";
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+
+  return SUCCESS;
+}
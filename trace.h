@@ -0,0 +1,64 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+
+/* Number of events kept per thread, must be a power of 2 */
+#define TRACE_RING_SIZE 4096
+
+/* Client ID of events that do not belong to a client */
+#define TRACE_NO_CLIENT 0xFFFF
+
+/*
+* NAME :        trace_type_t
+*
+* DESCRIPTION : Traced message service events
+*
+* MEMBERS :     TRACE_ALLOC - Message allocated from the pool
+*               TRACE_SEND - Message queued to a client
+*               TRACE_WAKE - Receiver woke up in recv
+*               TRACE_RECV - Receiver took a message from its mailbox
+*               TRACE_FREE - Message returned to the pool
+*
+* NOTES :      None
+*/
+typedef enum
+{
+  TRACE_ALLOC,
+  TRACE_SEND,
+  TRACE_WAKE,
+  TRACE_RECV,
+  TRACE_FREE
+} trace_type_t;
+
+/* Runtime switch, tested by TRACE_EVENT before anything else */
+extern volatile int trace_enabled;
+
+extern void trace_record(
+  trace_type_t type,
+  uint16_t client_id,
+  int32_t block);
+
+extern void trace_enable(
+  int enable);
+
+extern int trace_export(
+  const char *path);
+
+/*
+* Tracing is compiled in with -DMSG_TRACE. When compiled in but disabled at
+* runtime, an event costs one well predicted branch.
+*/
+#ifdef MSG_TRACE
+#define TRACE_EVENT(type, client_id, block)                   \
+  do                                                          \
+  {                                                           \
+    if (__builtin_expect(trace_enabled, 0))                   \
+    {                                                         \
+      trace_record((type), (client_id), (block));             \
+    }                                                         \
+  } while(0)
+#else
+#define TRACE_EVENT(type, client_id, block) do {} while(0)
+#endif
+
+#endif